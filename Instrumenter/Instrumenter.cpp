@@ -17,11 +17,13 @@
 
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringMap.h"
+#include "llvm/IR/CallSite.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/Support/Debug.h"
@@ -72,7 +74,9 @@ namespace {
                                           bool isWrite, uint32_t typeBytes,
                                           uint32_t funcId, uint32_t instId);
 
-        Instruction *getAllocsReplace(CallInst *ci, size_t fid, size_t iid);
+        Value *createInBounds(IRBuilder<> &IRB, Value *addr, Value *begin, Value *end);
+
+        Instruction *getAllocsReplace(CallSite cs, size_t fid, size_t iid);
 
         Function *checkInterfaceFunction(Constant *FuncOrBitcast);
 
@@ -84,6 +88,12 @@ namespace {
 
         DataLayout *TD;
         Function *accessCallback;
+        // Runtime-exported [begin, end) bounds of the heap and the globals.
+        Value *heapBegin, *heapEnd, *globalBegin, *globalEnd;
+        // Runtime-exported flags: bit 0 set while the program is multithreaded,
+        // bit 1 while a snapshot waits for threads to hand off.
+        Value *multithreaded;
+        MDNode *unlikelyWeights;
         StringMap<Function*> modifiedAllocs;
         StringMap<LibFuncInfo> libFuncs;
         Type *intptrType, *int64Type, *boolType;
@@ -111,6 +121,11 @@ static cl::opt<bool> toInstrumentAtomics(
         "instrument-atomics", cl::desc("instrument atomic instructions (rmw, cmpxchg)"),
         cl::Hidden, cl::init(true)
 );
+static cl::opt<bool> useFastPathFilter(
+        "fast-path-filter", cl::desc("only call handle_access for addresses "
+                                     "inside the runtime's heap/global bounds"),
+        cl::Hidden, cl::init(true)
+);
 
 Instrumenter::Instrumenter() : ModulePass(ID) {}
 
@@ -149,6 +164,15 @@ bool Instrumenter::doInitialization(Module &M) {
             intptrType, int64Type, int64Type, int64Type, boolType
     ));
 
+    // Defined in runtime/Runtime.cpp; kept up to date as the heap grows.
+    heapBegin = M.getOrInsertGlobal("__huron_heap_begin", intptrType);
+    heapEnd = M.getOrInsertGlobal("__huron_heap_end", intptrType);
+    globalBegin = M.getOrInsertGlobal("__huron_global_begin", intptrType);
+    globalEnd = M.getOrInsertGlobal("__huron_global_end", intptrType);
+    multithreaded = M.getOrInsertGlobal("__huron_multithreaded", intptrType);
+    // Most accesses are to the stack or to libraries, so the call is cold.
+    unlikelyWeights = MDBuilder(context).createBranchWeights(1, 100000);
+
     modifiedAllocs["malloc"] = checkInterfaceFunction(M.getOrInsertFunction(
             "malloc_inst", voidPtrType, int64Type, int64Type, int64Type
     ));
@@ -165,6 +189,39 @@ bool Instrumenter::doInitialization(Module &M) {
         "posix_memalign_inst", intType, voidPtrPtrType, int64Type, int64Type, int64Type, int64Type
     ));
 
+    // operator new and new[], plain, nothrow and aligned; the nothrow_t tag
+    // is dropped.
+    modifiedAllocs["_Znwm"] = modifiedAllocs["_Znam"] = checkInterfaceFunction(M.getOrInsertFunction(
+        "new_inst", voidPtrType, int64Type, int64Type, int64Type
+    ));
+
+    modifiedAllocs["_ZnwmRKSt9nothrow_t"] = modifiedAllocs["_ZnamRKSt9nothrow_t"] =
+        checkInterfaceFunction(M.getOrInsertFunction(
+            "new_nothrow_inst", voidPtrType, int64Type, int64Type, int64Type
+        ));
+
+    modifiedAllocs["_ZnwmSt11align_val_t"] = modifiedAllocs["_ZnamSt11align_val_t"] =
+        checkInterfaceFunction(M.getOrInsertFunction(
+            "new_aligned_inst", voidPtrType, int64Type, int64Type, int64Type, int64Type
+        ));
+
+    modifiedAllocs["_ZnwmSt11align_val_tRKSt9nothrow_t"] = modifiedAllocs["_ZnamSt11align_val_tRKSt9nothrow_t"] =
+        checkInterfaceFunction(M.getOrInsertFunction(
+            "new_aligned_nothrow_inst", voidPtrType, int64Type, int64Type, int64Type, int64Type
+        ));
+
+    modifiedAllocs["aligned_alloc"] = modifiedAllocs["memalign"] = checkInterfaceFunction(M.getOrInsertFunction(
+        "aligned_alloc_inst", voidPtrType, int64Type, int64Type, int64Type, int64Type
+    ));
+
+    modifiedAllocs["strdup"] = checkInterfaceFunction(M.getOrInsertFunction(
+        "strdup_inst", voidPtrType, voidPtrType, int64Type, int64Type
+    ));
+
+    modifiedAllocs["strndup"] = checkInterfaceFunction(M.getOrInsertFunction(
+        "strndup_inst", voidPtrType, voidPtrType, int64Type, int64Type, int64Type
+    ));
+
     populatelibFuncs();
 
     return true;
@@ -231,6 +288,12 @@ bool Instrumenter::instrumentMemAccessInst(
     return true;
 }
 
+Value *Instrumenter::createInBounds(IRBuilder<> &IRB, Value *addr, Value *begin, Value *end) {
+    Value *geBegin = IRB.CreateICmpUGE(addr, IRB.CreateLoad(begin));
+    Value *ltEnd = IRB.CreateICmpULT(addr, IRB.CreateLoad(end));
+    return IRB.CreateAnd(geBegin, ltEnd);
+}
+
 // General function call before some given instruction
 Instruction *Instrumenter::insertAccessCallback(
         Instruction *insertBefore, Value *addr, 
@@ -238,6 +301,23 @@ Instruction *Instrumenter::insertAccessCallback(
     IRBuilder<> IRB(insertBefore);
     Value *actualAddr = IRB.CreatePointerCast(addr, intptrType);
 
+    if (useFastPathFilter) {
+        // Only addresses the runtime could possibly record pay for the call,
+        // and only while more than one thread runs; handle_access does the
+        // exact per-allocation lookup itself. A pending snapshot lets every
+        // access through, so that a lone thread still hands off its log.
+        Value *inHeap = createInBounds(IRB, actualAddr, heapBegin, heapEnd);
+        Value *inGlobal = createInBounds(IRB, actualAddr, globalBegin, globalEnd);
+        Value *flags = IRB.CreateLoad(multithreaded);
+        Value *isShared = IRB.CreateICmpNE(IRB.CreateAnd(flags, ConstantInt::get(intptrType, 1)),
+                                           ConstantInt::get(intptrType, 0));
+        Value *isPending = IRB.CreateICmpNE(IRB.CreateAnd(flags, ConstantInt::get(intptrType, 2)),
+                                            ConstantInt::get(intptrType, 0));
+        Value *toCall = IRB.CreateOr(IRB.CreateAnd(isShared, IRB.CreateOr(inHeap, inGlobal)), isPending);
+        Instruction *thenTerm = SplitBlockAndInsertIfThen(toCall, insertBefore, false, unlikelyWeights);
+        IRB.SetInsertPoint(thenTerm);
+    }
+
     std::vector<Value *> arguments;
     arguments.push_back(actualAddr);
     arguments.push_back(ConstantInt::get(int64Type, funcId));
@@ -275,36 +355,25 @@ bool isLocalVariable(Value *value) {
     return isa<AllocaInst>(value);
 }
 
-Instruction *Instrumenter::getAllocsReplace(CallInst *ci, size_t fid, size_t iid) {
-    Function *callee = ci->getCalledFunction();
+Instruction *Instrumenter::getAllocsReplace(CallSite cs, size_t fid, size_t iid) {
+    Function *callee = cs.getCalledFunction();
     if (!callee)
         return nullptr;
-    StringRef name = callee->getName();
-    if (name == "malloc") {
-        SmallVector<Value *, 3> arguments {
-            ci->getArgOperand(0), 
-            ConstantInt::get(int64Type, fid), 
-            ConstantInt::get(int64Type, iid)
-        };
-        return CallInst::Create(modifiedAllocs[name], ArrayRef<Value *>(arguments));
-    } else if (name == "calloc" || name == "realloc") {
-        SmallVector<Value *, 4> arguments {
-            ci->getArgOperand(0), 
-            ci->getArgOperand(1), 
-            ConstantInt::get(int64Type, fid), 
-            ConstantInt::get(int64Type, iid)
-        };
-        return CallInst::Create(modifiedAllocs[name], ArrayRef<Value *>(arguments));
-    } else if (name == "posix_memalign") {
-        SmallVector<Value *, 5> arguments {
-            ci->getArgOperand(0),
-            ci->getArgOperand(1),
-            ci->getArgOperand(2),
-            ConstantInt::get(int64Type, fid),
-            ConstantInt::get(int64Type, iid)
-        };
-        return CallInst::Create(modifiedAllocs[name], ArrayRef<Value *>(arguments));
-    } else return nullptr;
+    auto it = modifiedAllocs.find(callee->getName());
+    if (it == modifiedAllocs.end())
+        return nullptr;
+    Function *replace = it->second;
+    // Each *_inst function takes the leading arguments of the call it
+    // replaces, then the site ids.
+    unsigned nKept = replace->getFunctionType()->getNumParams() - 2;
+    SmallVector<Value *, 5> arguments(cs.arg_begin(), cs.arg_begin() + nKept);
+    arguments.push_back(ConstantInt::get(int64Type, fid));
+    arguments.push_back(ConstantInt::get(int64Type, iid));
+    // operator new may throw, so C++ code often invokes it.
+    if (InvokeInst *ii = dyn_cast<InvokeInst>(cs.getInstruction()))
+        return InvokeInst::Create(replace, ii->getNormalDest(), ii->getUnwindDest(),
+                                  ArrayRef<Value *>(arguments));
+    return CallInst::Create(replace, ArrayRef<Value *>(arguments));
 }
 
 bool Instrumenter::runOnModule(Module &M) {
@@ -315,21 +384,27 @@ bool Instrumenter::runOnModule(Module &M) {
         if (fb->isDeclaration())
             continue;
         funcNames.insert(std::make_pair(funcCounter, fb->getName()));
-        // Fill the set of memory operations to instrument.
+        // Number all instructions up front: the fast path filter splits
+        // basic blocks, which would invalidate the iterators below.
         uint32_t instCounter = 0;
-        std::vector<std::pair<Instruction *, Instruction *>> allocsReplace;
+        std::vector<std::pair<Instruction *, uint32_t>> toInstrument;
         for (Function::iterator bb = fb->begin(), FE = fb->end(); bb != FE; ++bb) {
             for (BasicBlock::iterator ins = bb->begin(), BE = bb->end(); ins != BE;
-                 ++ins, ++instCounter) {
-                bool processed = instrumentMemAccessInst(&*ins, funcCounter, instCounter);
-                if (processed) 
-                    numInsted += (int)processed;
-                if (CallInst *ci = dyn_cast<CallInst>(&*ins)) {
-                    Instruction *rep = getAllocsReplace(ci, funcCounter, instCounter);
-                    if (rep)
-                        allocsReplace.emplace_back(&*ins, rep);
-                    numInsted++;
-                }
+                 ++ins, ++instCounter)
+                toInstrument.emplace_back(&*ins, instCounter);
+        }
+        // Fill the set of memory operations to instrument.
+        std::vector<std::pair<Instruction *, Instruction *>> allocsReplace;
+        for (const auto &p: toInstrument) {
+            Instruction *ins = p.first;
+            bool processed = instrumentMemAccessInst(ins, funcCounter, p.second);
+            if (processed) 
+                numInsted += (int)processed;
+            if (CallSite cs = CallSite(ins)) {
+                Instruction *rep = getAllocsReplace(cs, funcCounter, p.second);
+                if (rep)
+                    allocsReplace.emplace_back(ins, rep);
+                numInsted++;
             }
         }
         for (const auto &p: allocsReplace)
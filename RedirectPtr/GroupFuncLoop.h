@@ -72,20 +72,17 @@ private:
     }
 
     void adjustMalloc(Instruction *inst, long sizeAdd) const {
-        // allocs are no-throw and won't be invoked.
+        // Only allocations that are called, not invoked, are resized.
         CallInst *call = cast<CallInst>(inst);
         StringRef name = call->getCalledFunction()->getName();
-        Value *origSize = nullptr;
-        if (name == "malloc")
-            origSize = call->getArgOperand(0);
-        else if (name == "calloc")
+        if (name == "calloc")
             assert(false && "Not implemented");
-        else if (name == "realloc")
-            origSize = call->getArgOperand(1);
+        int index = allocSizeOperand(name);
+        Value *origSize = call->getArgOperand(index);
         IRBuilder<> IRB(inst);
         Constant *addValue = ConstantInt::get(sizeType, sizeAdd, /*isSigned=*/true);
         Value *newSize = IRB.CreateAdd(origSize, addValue);
-        call->setArgOperand(0, newSize);
+        call->setArgOperand(index, newSize);
     }
 
     void getAllLoops(Function &func, LoopInfo *li) {
@@ -15,6 +15,16 @@ using namespace llvm;
 #define LLVM_DEBUG(X) {X;}
 #endif
 
+// Operand holding the size for the allocation functions that can be resized,
+// -1 for other functions. calloc's size is a product and is not handled.
+inline int allocSizeOperand(StringRef name) {
+    if (name == "malloc" || name.startswith("_Znwm") || name.startswith("_Znam"))
+        return 0;
+    if (name == "realloc" || name == "aligned_alloc" || name == "memalign")
+        return 1;
+    return -1;
+}
+
 class PCInfo {
 public:
     explicit PCInfo(const std::vector<std::tuple<size_t, size_t, size_t>> &lines)
@@ -47,12 +57,12 @@ public:
             return isa<LoadInst>(inst) || isa<StoreInst>(inst) ||
                    isa<AtomicRMWInst>(inst) || isa<AtomicCmpXchgInst>(inst);
         } else {
-            // allocs are no-throw and won't be invoked.
+            // Only allocations that are called, not invoked, are resized.
             CallInst *ci = dyn_cast<CallInst>(inst);
             if (!ci)
                 return false;
             StringRef name = ci->getCalledFunction()->getName();
-            return name == "malloc" || name == "calloc" || name == "realloc";
+            return name == "calloc" || allocSizeOperand(name) >= 0;
         }
     }
 
@@ -10,18 +10,32 @@
 #include <map>
 #include <stack>
 #include <numeric>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <cstdio>
 #include "Detect.h"
+#include "LogFormat.h"
 
 using namespace std;
 
 struct Record {
     size_t addr;
     int m_id;
-    uint16_t thread, size;
+    // Unique over the whole run, so not bounded by the number of slots.
+    uint32_t thread;
+    uint16_t size;
     PC pc;
     RW rw;
+    // Accesses rw may be missing, from the runtime's heavy-hitter mode.
+    uint64_t err;
+    // Barrier phase, 0 unless the runtime tracked phases.
+    uint32_t phase;
+    // Coarse TSC of the first and last access; 0 if the log does not have them.
+    uint64_t first, last;
 
-    Record() : addr(0), m_id(0), thread(0), size(0), pc(0, 0), rw(0, 0) {}
+    Record() : addr(0), m_id(0), thread(0), size(0), pc(0, 0), rw(0, 0), err(0), phase(0), first(0), last(0) {}
 
     friend istream &operator>>(istream &is, Record &rec) {
         static CSVParser csv(9);
@@ -30,7 +44,7 @@ struct Record {
         if (line.empty())
             return is;
         const auto &fields = csv.read_csv_line(line);
-        rec.thread = to_unsigned<uint16_t>(fields[0]);
+        rec.thread = to_unsigned<uint32_t>(fields[0]);
         rec.addr = to_address(fields[1]);
         rec.m_id = to_signed<int>(fields[2]);
         rec.pc.func = to_unsigned<uint16_t>(fields[4]);
@@ -41,14 +55,35 @@ struct Record {
 
         return is;
     }
+
+    void read_row(vector<logfmt::ColumnReader> &cols) {
+        using namespace logfmt;
+        thread = (uint32_t) cols[R_THREAD].get();
+        addr = cols[R_ADDR].get_delta();
+        m_id = (int) cols[R_M_ID].get_signed();
+        cols[R_M_OFFSET].get();
+        pc.func = (uint16_t) cols[R_FUNC].get();
+        pc.inst = (uint16_t) cols[R_INST].get();
+        size = (uint16_t) cols[R_SIZE].get();
+        rw.r = (uint32_t) cols[R_READS].get();
+        rw.w = (uint32_t) cols[R_WRITES].get();
+        err = cols[R_ERROR].get();
+        phase = (uint32_t) cols[R_PHASE].get();
+        first = cols[R_FIRST].get_delta();
+        last = first + cols[R_SPAN].get();
+    }
 };
 
 struct MallocInfo {
     size_t start, size;
     PC pc;
     int id;
+    // Allocating thread; -1 for globals and in logs that do not have it.
+    int thread;
+    // Hash of the frames above the allocation site, 0 if not recorded.
+    uint64_t stack;
 
-    MallocInfo() : start(0), size(0), pc(0, 0), id(0) {}
+    MallocInfo() : start(0), size(0), pc(0, 0), id(0), thread(-1), stack(0) {}
 
     friend istream &operator>>(istream &is, MallocInfo &mal) {
         static CSVParser csv(5);
@@ -70,19 +105,81 @@ struct MallocInfo {
         return is;
     }
 
+    void read_row(vector<logfmt::ColumnReader> &cols) {
+        using namespace logfmt;
+        id = (int) cols[M_ID].get_signed();
+        start = cols[M_START].get_delta();
+        size = cols[M_SIZE].get();
+        int64_t func = cols[M_FUNC].get_signed(), inst = cols[M_INST].get_signed();
+        if (func == FUNC_GLOBAL)
+            pc = PC::null();
+        else {
+            pc.func = (uint16_t) func;
+            pc.inst = (uint16_t) inst;
+        }
+        thread = cols[M_THREAD].empty() ? -1 : (int) cols[M_THREAD].get_signed();
+        stack = cols[M_STACK].get();
+    }
+
     bool operator<(const MallocInfo &rhs) const {
         return id < rhs.id;
     }
 };
 
+// When each thread of the run was alive, from the THREADS block of a binary
+// malloc file. Threads it does not know about are taken to run all along.
+class ThreadLifetimes {
+public:
+    explicit ThreadLifetimes(const string &path) {
+        MappedFile mapped(path);
+        if (!logfmt::BlockReader::is_binary(mapped.data(), mapped.size()))
+            return;
+        logfmt::BlockReader reader(mapped.data(), mapped.size());
+        logfmt::BlockHeader header{};
+        vector<logfmt::ColumnReader> cols;
+        while (reader.next(header, cols, logfmt::T_NCOLS)) {
+            if (header.kind != logfmt::THREADS)
+                continue;
+            for (uint32_t i = 0; i < header.n_rows; i++) {
+                uint32_t index = (uint32_t) cols[logfmt::T_INDEX].get();
+                uint64_t start = cols[logfmt::T_START].get(), end = cols[logfmt::T_END].get();
+                lifetimes[index] = make_pair(start, end ? end : UINT64_MAX);
+            }
+        }
+    }
+
+    size_t size() const {
+        return lifetimes.size();
+    }
+
+    // False only for two threads known to have never run at the same time.
+    bool overlap(uint32_t a, uint32_t b) const {
+        auto ia = lifetimes.find(a), ib = lifetimes.find(b);
+        if (ia == lifetimes.end() || ib == lifetimes.end())
+            return true;
+        return ia->second.first < ib->second.second && ib->second.first < ia->second.second;
+    }
+
+private:
+    unordered_map<uint32_t, pair<uint64_t, uint64_t>> lifetimes;
+};
+
 class AddrRecord {
 public:
     friend class MallocStorageT;
 
-    AddrRecord(Segment _range, int m_id, size_t m_start, const vector<Record> &records) :
-            range(_range), malloc_start(m_start), malloc_id(m_id) {
+    // Takes the records of `records` in `_phase`.
+    AddrRecord(Segment _range, int m_id, size_t m_start, uint32_t _phase, const vector<Record> &records) :
+            range(_range), malloc_start(m_start), malloc_id(m_id), phase(_phase) {
         for (const auto &rec: records) {
+            if (rec.phase != phase)
+                continue;
             thread_rw[rec.thread] += rec.rw;
+            if (rec.first) {
+                auto it = thread_window.emplace(rec.thread, make_pair(rec.first, rec.last)).first;
+                it->second.first = min(it->second.first, rec.first);
+                it->second.second = max(it->second.second, rec.last);
+            }
             pc_rw[rec.pc] += rec.rw;
             pc_threads.emplace(rec.pc, rec.thread);
         }
@@ -98,6 +195,8 @@ public:
         auto p = rec.cachelines();
         size_t addr_start = rec.malloc_start + rec.range.start, addr_end = rec.malloc_start + rec.range.end;
         size_t l = addr_start - (p.first << CACHELINE_BIT), r = addr_end - (p.second << CACHELINE_BIT);
+        if (rec.phase)
+            os << "phase " << rec.phase << ": ";
         os << hex;
         if (p.first != p.second)
             os << "(" << p.first << "+0x" << l << ", " << p.second << "+0x" << r << ");";
@@ -144,22 +243,30 @@ public:
         return threads;
     }
 
-    static RW get_total_rw(const vector<AddrRecord> &records) {
+    static RW get_total_rw_of(const vector<AddrRecord> &records, const vector<bool> &threads) {
         RW ret;
         for (const auto &rec: records)
             for (const auto &p: rec.thread_rw)
-                ret += p.second;
+                if (p.first < threads.size() && threads[p.first])
+                    ret += p.second;
         return ret;
     }
 
-    static RW get_total_rw_excluding(const vector<AddrRecord> &records,
-                                     const vector<bool> &exclude_threads) {
-        RW ret;
+    // [first, last] time span of the accesses of `threads`, as a half-open
+    // interval; (0, 0) if unknown.
+    static pair<uint64_t, uint64_t> get_window_of(const vector<AddrRecord> &records, const vector<bool> &threads) {
+        pair<uint64_t, uint64_t> ret(UINT64_MAX, 0);
         for (const auto &rec: records)
-            for (const auto &p: rec.thread_rw)
-                if (exclude_threads.size() <= p.first || !exclude_threads[p.first])
-                    ret += p.second;
-        return ret;
+            for (const auto &p: rec.thread_window)
+                if (p.first < threads.size() && threads[p.first]) {
+                    ret.first = min(ret.first, p.second.first);
+                    ret.second = max(ret.second, p.second.second + 1);
+                }
+        return ret.second ? ret : make_pair(0UL, 0UL);
+    }
+
+    uint32_t get_phase() const {
+        return phase;
     }
 
     bool operator==(const AddrRecord &rhs) const {
@@ -172,11 +279,14 @@ public:
 
 private:
     unordered_map <uint32_t, RW> thread_rw;
+    // Time span of each thread's accesses, if the log has times.
+    unordered_map <uint32_t, pair<uint64_t, uint64_t>> thread_window;
     unordered_map <PC, RW> pc_rw;
     unordered_multimap <PC, uint32_t> pc_threads;
     Segment range;
     size_t malloc_start;
     int malloc_id;
+    uint32_t phase;
 };
 
 class Graph {
@@ -190,10 +300,43 @@ private:
         explicit GraphGroup(pair<vector<bool>, vector<AddrRecord>> &&pair) :
                 threads(std::move(pair.first)), records(std::move(pair.second)) {}
 
-        static size_t rhs_rw_suffer_from_lhs(const GraphGroup &lhs, const GraphGroup &rhs) {
-            RW lhs_rw = AddrRecord::get_total_rw(lhs.records);
-            RW rhs_minus_lhs_rw = AddrRecord::get_total_rw_excluding(rhs.records, lhs.threads);
-            return min(lhs_rw.w, rhs_minus_lhs_rw.r + rhs_minus_lhs_rw.w);
+        // Threads in `threads` but not in `but` that were alive at the same
+        // time as one in `with`.
+        static vector<bool> concurrent(const vector<bool> &threads, const vector<bool> &but,
+                                       const vector<bool> &with, const ThreadLifetimes &lifetimes) {
+            vector<bool> ret(threads.size());
+            for (size_t i = 0; i < threads.size(); i++) {
+                if (!threads[i] || (i < but.size() && but[i]))
+                    continue;
+                for (size_t j = 0; j < with.size() && !ret[i]; j++)
+                    ret[i] = with[j] && lifetimes.overlap(i, j);
+            }
+            return ret;
+        }
+
+        // Only accesses of threads that ran alongside one on the other side
+        // can suffer from, or cause, false sharing. With access times, each
+        // side only counts the share of its accesses that falls in the time
+        // both sides used the line (taking accesses as spread evenly).
+        static size_t rhs_rw_suffer_from_lhs(const GraphGroup &lhs, const GraphGroup &rhs,
+                                             const ThreadLifetimes &lifetimes) {
+            vector<bool> rhs_only = concurrent(rhs.threads, lhs.threads, lhs.threads, lifetimes);
+            vector<bool> lhs_alongside = concurrent(lhs.threads, vector<bool>(), rhs_only, lifetimes);
+            RW lhs_rw = AddrRecord::get_total_rw_of(lhs.records, lhs_alongside);
+            RW rhs_minus_lhs_rw = AddrRecord::get_total_rw_of(rhs.records, rhs_only);
+            double lhs_share = 1, rhs_share = 1;
+            auto lhs_window = AddrRecord::get_window_of(lhs.records, lhs_alongside);
+            auto rhs_window = AddrRecord::get_window_of(rhs.records, rhs_only);
+            if (lhs_window.second && rhs_window.second) {
+                uint64_t begin = max(lhs_window.first, rhs_window.first);
+                uint64_t end = min(lhs_window.second, rhs_window.second);
+                double overlap = end > begin ? (double) (end - begin) : 0;
+                lhs_share = overlap / (double) (lhs_window.second - lhs_window.first);
+                rhs_share = overlap / (double) (rhs_window.second - rhs_window.first);
+            }
+            auto lhs_w = (size_t) (lhs_rw.w * lhs_share + 0.5);
+            auto rhs_rw = (size_t) ((rhs_minus_lhs_rw.r + rhs_minus_lhs_rw.w) * rhs_share + 0.5);
+            return min(lhs_w, rhs_rw);
         }
 
         friend ostream &operator<<(ostream &os, const GraphGroup &gg) {
@@ -216,11 +359,11 @@ private:
     };
 
 public:
-    explicit Graph(pair<size_t, vector<AddrRecord>> &&_records) :
+    Graph(pair<size_t, vector<AddrRecord>> &&_records, const ThreadLifetimes &lifetimes) :
             clid(_records.first) {
         records = move(_records.second);
         sort(records.begin(), records.end());
-        estm_fs = estm_false_sharing();
+        estm_fs = estm_false_sharing(lifetimes);
     }
 
     vector<GraphGroup> thread_groups(const vector<AddrRecord> &v) const {
@@ -237,6 +380,11 @@ public:
         return estm_fs;
     }
 
+    // Estimate of each barrier phase with any.
+    const map<uint32_t, size_t> &get_phase_false_sharing() const {
+        return phase_fs;
+    }
+
     bool operator<(const Graph &rhs) const {
         return clid < rhs.clid;
     }
@@ -250,14 +398,29 @@ public:
     }
 
 private:
-    size_t estm_false_sharing() const {
+    // Threads only contend within a barrier phase: estimate each on its own.
+    size_t estm_false_sharing(const ThreadLifetimes &lifetimes) {
+        map<uint32_t, vector<AddrRecord>> phases;
+        for (const auto &rec: records)
+            phases[rec.get_phase()].push_back(rec);
         size_t total_rw = 0;
-        auto groups = thread_groups(records);
+        for (const auto &p: phases) {
+            size_t phase_rw = estm_false_sharing(p.second, lifetimes);
+            if (phase_rw)
+                phase_fs[p.first] = phase_rw;
+            total_rw += phase_rw;
+        }
+        return total_rw;
+    }
+
+    size_t estm_false_sharing(const vector<AddrRecord> &v, const ThreadLifetimes &lifetimes) const {
+        size_t total_rw = 0;
+        auto groups = thread_groups(v);
         for (size_t i = 0; i < groups.size(); i++) {
             size_t max_rw = 0;
             for (size_t j = i + 1; j < groups.size(); j++) {
-                size_t ij_rw = GraphGroup::rhs_rw_suffer_from_lhs(groups[i], groups[j]);
-                size_t ji_rw = GraphGroup::rhs_rw_suffer_from_lhs(groups[j], groups[i]);
+                size_t ij_rw = GraphGroup::rhs_rw_suffer_from_lhs(groups[i], groups[j], lifetimes);
+                size_t ji_rw = GraphGroup::rhs_rw_suffer_from_lhs(groups[j], groups[i], lifetimes);
                 max_rw = max(max_rw, max(ij_rw, ji_rw));
             }
             total_rw += max_rw;
@@ -266,6 +429,7 @@ private:
     }
 
     size_t clid, estm_fs;
+    map<uint32_t, size_t> phase_fs;
     vector<AddrRecord> records;
 };
 
@@ -281,15 +445,19 @@ public:
     explicit MallocStorageT(
             int _m_id, const MallocInfo &_m,
             const std::unordered_map<Segment, vector<Record>> &bucket,
-            size_t graph_threshold) :
+            size_t graph_threshold, const ThreadLifetimes &lifetimes) :
             minfo(_m), malloc_fs(0), m_id(_m_id) {
         size_t m_start = _m.start;
         find_overlap(_m_id, m_start, bucket);
         for (const auto &p: bucket) {
             Segment seg = p.first.shift_by(m_start, false);
-            records.emplace_back(seg, _m_id, m_start, p.second);
+            set<uint32_t> phases;
+            for (const auto &rec: p.second)
+                phases.insert(rec.phase);
+            for (uint32_t phase: phases)
+                records.emplace_back(seg, _m_id, m_start, phase, p.second);
         }
-        calc_graphs(graph_threshold);
+        calc_graphs(graph_threshold, lifetimes);
     }
 
     bool valid() {
@@ -304,8 +472,44 @@ public:
         return make_pair(minfo.pc, minfo.size);
     }
 
+    // Only 1/n of the cache lines were tracked: scale the estimate up.
+    void extrapolate(size_t n) {
+        malloc_fs *= n;
+        for (auto &p: phase_fs)
+            p.second *= n;
+    }
+
+    const map<uint32_t, size_t> &get_phase_false_sharing() const {
+        return phase_fs;
+    }
+
+    const MallocInfo &get_minfo() const {
+        return minfo;
+    }
+
+    void set_frames(const vector<string> &_frames) {
+        frames = _frames;
+    }
+
+    void set_name(const string &_name) {
+        name = _name;
+    }
+
     friend ostream &operator<<(ostream &os, const MallocStorageT &mst) {
-        os << "=================" << mst.m_id << "(" << mst.malloc_fs << ")================\n";
+        os << "=================" << mst.m_id << "(" << mst.malloc_fs << ")";
+        if (mst.minfo.pc.is_stack())
+            os << " stack of thread " << mst.minfo.thread;
+        else if (mst.minfo.pc.is_tls())
+            os << " TLS of thread " << mst.minfo.thread;
+        else if (mst.minfo.pc.is_region())
+            os << " registered with tag " << mst.minfo.pc.inst << " by thread " << mst.minfo.thread;
+        else if (mst.minfo.pc.is_global_var())
+            os << " global " << (mst.name.empty() ? to_string(mst.minfo.pc.inst) : mst.name);
+        else if (mst.minfo.thread >= 0)
+            os << " by thread " << mst.minfo.thread;
+        os << "================\n";
+        for (const string &frame: mst.frames)
+            os << "  at " << frame << '\n';
         for (const Graph &g: mst.graphs)
             os << g;
         return os;
@@ -313,14 +517,17 @@ public:
 
     vector<RecT> get_api_output() const {
         vector<RecT> ret;
+        // A range has a record per phase; list each access once.
+        set<RecT> seen;
         for (const auto &rec: records)
             for (const auto &p: rec.pc_threads)
-                ret.emplace_back(rec.range, p.first, p.second);
+                if (seen.emplace(rec.range, p.first, p.second).second)
+                    ret.emplace_back(rec.range, p.first, p.second);
         return ret;
     }
 
 private:
-    void calc_graphs(size_t threshold) {
+    void calc_graphs(size_t threshold, const ThreadLifetimes &lifetimes) {
         map<size_t, vector<AddrRecord>> cachelines;
         for (const auto &rec: records) {
             auto cls = rec.cachelines();
@@ -331,11 +538,14 @@ private:
         for (auto &p: cachelines)
             sort(p.second.begin(), p.second.end());
         graphs.reserve(cachelines.size());
-        for (const auto &pair: cachelines)
-            graphs.emplace_back(pair);
+        for (auto &pair: cachelines)
+            graphs.emplace_back(move(pair), lifetimes);
         sort(graphs.begin(), graphs.end());
         malloc_fs = accumulate(graphs.begin(), graphs.end(), 0ul,
                                [](size_t rhs, const Graph &lhs) { return rhs + lhs.get_n_false_sharing(); });
+        for (const Graph &g: graphs)
+            for (const auto &p: g.get_phase_false_sharing())
+                phase_fs[p.first] += p.second;
         graphs.erase(remove_if(graphs.begin(), graphs.end(), [threshold](const Graph &g) {
             return g.get_n_false_sharing() < threshold;
         }), graphs.end());
@@ -358,17 +568,94 @@ private:
     vector<AddrRecord> records;
     vector<Graph> graphs;
     MallocInfo minfo;
+    // Symbolized allocation stack, if the runtime recorded stacks.
+    vector<string> frames;
+    // Name and module of a global variable.
+    string name;
     size_t malloc_fs;
+    // malloc_fs by barrier phase.
+    map<uint32_t, size_t> phase_fs;
     int m_id;
 };
 
+// Decodes the blocks of one segment of a binary log into `out`.
+template<typename T>
+static void read_segment(const uint8_t *data, const logfmt::SegmentEntry &seg, logfmt::Kind kind, size_t n_cols,
+                         vector<T> &out) {
+    logfmt::BlockReader reader(data + seg.offset, seg.length);
+    logfmt::BlockHeader header{};
+    vector<logfmt::ColumnReader> cols;
+    T next;
+    while (reader.next(header, cols, n_cols)) {
+        if (header.kind != kind)
+            continue;
+        for (uint32_t i = 0; i < header.n_rows; i++) {
+            next.read_row(cols);
+            out.push_back(next);
+        }
+    }
+}
+
+// Calls `callback` on every T in the file at `path`, either in the binary
+// format written by the runtime (read through a memory map) or in the old CSV.
+// Segments of a binary container are decoded in parallel, but passed to
+// `callback` in file order.
+template<typename T, typename CallbackT>
+static void read_log(const string &path, ifstream &csv_file, logfmt::Kind kind, size_t n_cols,
+                     CallbackT callback) {
+    MappedFile mapped(path);
+    if (!logfmt::BlockReader::is_binary(mapped.data(), mapped.size())) {
+        T next;
+        while (csv_file >> next)
+            callback(next);
+        return;
+    }
+    vector<logfmt::SegmentEntry> segments;
+    if (!logfmt::read_segments(mapped.data(), mapped.size(), segments))
+        throw invalid_argument("Malformed log container " + path);
+    auto *data = (const uint8_t *) mapped.data();
+    vector<vector<T>> decoded(segments.size());
+    atomic<size_t> next_seg(0);
+    auto worker = [&]() {
+        for (size_t i; (i = next_seg++) < segments.size();)
+            read_segment(data, segments[i], kind, n_cols, decoded[i]);
+    };
+    size_t n_workers = min<size_t>(max(thread::hardware_concurrency(), 1U), segments.size());
+    vector<thread> workers;
+    for (size_t i = 1; i < n_workers; i++)
+        workers.emplace_back(worker);
+    worker();
+    for (auto &w: workers)
+        w.join();
+    for (auto &seg: decoded) {
+        for (const auto &next: seg)
+            callback(next);
+        vector<T>().swap(seg);
+    }
+}
+
+// One in how many cache lines the runtime tracked, from the META block of a
+// binary malloc file; 1 if there is none.
+static size_t read_line_sample(const string &path) {
+    MappedFile mapped(path);
+    if (!logfmt::BlockReader::is_binary(mapped.data(), mapped.size()))
+        return 1;
+    logfmt::BlockReader reader(mapped.data(), mapped.size());
+    logfmt::BlockHeader header{};
+    vector<logfmt::ColumnReader> cols;
+    while (reader.next(header, cols, logfmt::META_NCOLS))
+        if (header.kind == logfmt::META && header.n_rows)
+            return max<size_t>(cols[logfmt::META_LINE_SAMPLE].get(), 1);
+    return 1;
+}
+
 DetectPass::DetectPass(const string &in, const vector<string> &rest) :
-        log_file(in),
+        log_path(in), log_file(in),
         summary_file(insert_suffix(in, "_summary")),
         fsrStat(insert_suffix(in, "_fs_malloc")) {
     assert(rest.size() <= 2);
     threshold = (!rest.empty()) ? stoul(rest[0]) : 100;
-    string malloc_path = (rest.size() == 2) ? rest[1] : "mallocRuntimeIDs.txt";
+    malloc_path = (rest.size() == 2) ? rest[1] : "mallocRuntimeIDs.txt";
     malloc_file.open(malloc_path);
     check_in_files();
 }
@@ -376,29 +663,56 @@ DetectPass::DetectPass(const string &in, const vector<string> &rest) :
 void DetectPass::compute() {
     map<int, std::unordered_map<Segment, vector<Record>>> bins;
     map<int, MallocInfo> mallocs;
-    Record next_r;
-    MallocInfo next_m;
-    while (malloc_file >> next_m)
-        mallocs[next_m.id] = next_m;
-    size_t i = 0;
-    while (log_file >> next_r) {
-        if (!(i++ % 10000))
-            cout << "line of log read: " << i - 1 << endl;
-        auto key = Segment(next_r.addr, next_r.addr + next_r.size);
-        bins[next_r.m_id][key].push_back(next_r);
+    read_log<MallocInfo>(malloc_path, malloc_file, logfmt::MALLOCS, logfmt::M_NCOLS,
+                         [&mallocs](const MallocInfo &next_m) {
+                             mallocs[next_m.id] = next_m;
+                         });
+    size_t line_sample = read_line_sample(malloc_path);
+    if (line_sample > 1) {
+        cout << "1 in " << line_sample << " cache lines was sampled; "
+             << "false sharing per malloc is extrapolated from them" << endl;
+        summary_file << "# 1 in " << line_sample << " cache lines sampled; "
+                     << "per-malloc counts extrapolated by " << line_sample << '\n';
     }
+    ThreadLifetimes lifetimes(malloc_path);
+    if (lifetimes.size())
+        cout << "Lifetimes of " << lifetimes.size() << " threads read; "
+             << "threads that never ran together are not counted against each other" << endl;
+    size_t i = 0;
+    uint64_t max_err = 0;
+    read_log<Record>(log_path, log_file, logfmt::RECORDS, logfmt::R_NCOLS,
+                     [&bins, &i, &max_err](const Record &next_r) {
+                         if (!(i++ % 10000))
+                             cout << "line of log read: " << i - 1 << endl;
+                         max_err = max(max_err, next_r.err);
+                         auto key = Segment(next_r.addr, next_r.addr + next_r.size);
+                         bins[next_r.m_id][key].push_back(next_r);
+                     });
     cout << "line of log read: " << i - 1 << endl;
+    if (max_err) {
+        cout << "Only heavy hitters were logged; a record may miss up to "
+             << max_err << " accesses" << endl;
+        summary_file << "# heavy hitters only; counts per record low by at most "
+                     << max_err << '\n';
+    }
     i = 0;
+    map<uint32_t, size_t> phase_fs;
     for (const auto &p: bins) {
         if (!(i++ % 1000))
             cout << "# of mallocs processed: " << i - 1 << '/' << bins.size() << endl;
-        auto *mst = new MallocStorageT(p.first, mallocs[p.first], p.second, threshold);
+        auto *mst = new MallocStorageT(p.first, mallocs[p.first], p.second, threshold, lifetimes);
+        mst->extrapolate(line_sample);
+        for (const auto &q: mst->get_phase_false_sharing())
+            phase_fs[q.first] += q.second;
         if (mst->valid())
             this->data.emplace(p.first, mst);
         else
             delete mst;
     }
     cout << "# of mallocs processed: " << bins.size() << '/' << bins.size() << endl;
+    report_phases(phase_fs);
+    attach_frames();
+    attach_globals();
     for (auto &pair: this->data) {
         fsrStat.emplace(pair.second->get_n_false_sharing(), pair.first);
         summary_file << *(pair.second);
@@ -422,6 +736,77 @@ void DetectPass::print_result(const string &out) {
         outfile << p;
 }
 
+// With barrier phases in the log, lists the phases with the most false
+// sharing, so that one can see which phases of the program contend.
+void DetectPass::report_phases(const map<uint32_t, size_t> &phase_fs) {
+    if (phase_fs.empty() || (phase_fs.size() == 1 && phase_fs.begin()->first == 0))
+        return;
+    vector<pair<size_t, uint32_t>> hot;
+    for (const auto &p: phase_fs)
+        hot.emplace_back(p.second, p.first);
+    size_t n = min<size_t>(hot.size(), 10);
+    partial_sort(hot.begin(), hot.begin() + n, hot.end(), greater<pair<size_t, uint32_t>>());
+    cout << "False sharing in " << phase_fs.size() << " barrier phase(s); hottest:" << endl;
+    for (size_t j = 0; j < n; j++) {
+        cout << "  phase " << hot[j].second << ": " << hot[j].first << endl;
+        summary_file << "# phase " << hot[j].second << ": " << hot[j].first << '\n';
+    }
+}
+
+// mallocSites.txt is written next to the malloc file when the runtime records
+// allocation stacks; only the sites of reported mallocs are kept.
+void DetectPass::attach_frames() {
+    size_t slash = malloc_path.rfind('/');
+    string dir = slash == string::npos ? "" : malloc_path.substr(0, slash + 1);
+    ifstream sites_file(dir + "mallocSites.txt");
+    if (!sites_file)
+        return;
+    map<tuple<uint16_t, uint16_t, uint64_t>, vector<MallocStorageT *>> reported;
+    for (auto &p: this->data) {
+        const MallocInfo &minfo = p.second->get_minfo();
+        reported[make_tuple(minfo.pc.func, minfo.pc.inst, minfo.stack)].push_back(p.second);
+    }
+    string line;
+    while (getline(sites_file, line)) {
+        uint64_t func, inst, stack;
+        if (sscanf(line.c_str(), "%lu,%lu,%lu", &func, &inst, &stack) != 3)
+            continue;
+        vector<string> frames;
+        while (getline(sites_file, line) && !line.empty())
+            frames.push_back(line);
+        auto it = reported.find(make_tuple((uint16_t) func, (uint16_t) inst, stack));
+        if (it == reported.end())
+            continue;
+        for (auto *mst: it->second)
+            mst->set_frames(frames);
+    }
+}
+
+// mallocGlobals.txt, next to the malloc file, names the global variables
+// the runtime found in the symbol tables, as "k name module".
+void DetectPass::attach_globals() {
+    size_t slash = malloc_path.rfind('/');
+    string dir = slash == string::npos ? "" : malloc_path.substr(0, slash + 1);
+    ifstream names_file(dir + "mallocGlobals.txt");
+    if (!names_file)
+        return;
+    map<uint16_t, MallocStorageT *> reported;
+    for (auto &p: this->data)
+        if (p.second->get_minfo().pc.is_global_var())
+            reported.emplace(p.second->get_minfo().pc.inst, p.second);
+    string line;
+    while (!reported.empty() && getline(names_file, line)) {
+        size_t name_at = line.find(' ') + 1, module_at = line.find(' ', name_at);
+        if (!name_at || module_at == string::npos)
+            continue;
+        auto it = reported.find((uint16_t) strtoul(line.c_str(), nullptr, 10));
+        if (it == reported.end())
+            continue;
+        it->second->set_name(line.substr(name_at, module_at - name_at) + " in " + line.substr(module_at + 1));
+        reported.erase(it);
+    }
+}
+
 void DetectPass::check_in_files() {
     if (log_file.fail() || malloc_file.fail())
         throw std::invalid_argument("Can't open file\n");
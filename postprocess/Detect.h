@@ -46,6 +46,13 @@ public:
 private:
     void check_in_files();
 
+    void attach_frames();
+
+    void attach_globals();
+
+    void report_phases(const std::map<uint32_t, size_t> &phase_fs);
+
+    std::string log_path, malloc_path;
     std::ifstream log_file, malloc_file;
     std::ofstream summary_file;
     size_t threshold;
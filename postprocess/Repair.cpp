@@ -320,8 +320,23 @@ RepairPass::RepairPass(DetectPass::ApiT &&in, const vector<string> &rest) {
 
 void RepairPass::compute() {
     for (const auto &p: input) {
+        // Nothing to resize: the variables there need padding by hand.
+        if (p.pc.is_stack() || p.pc.is_tls()) {
+            cerr << "False sharing in the " << (p.pc.is_stack() ? "stack" : "TLS") << " of thread "
+                 << p.pc.inst << " is not repaired" << endl;
+            continue;
+        }
         AnalysisResult *ap = analysis.empty() ? nullptr : &analysis;
         Layout layout(p.accesses, p.pc, target_thread_count, ap);
+        // Its accesses cannot be redirected either, but the padded size is a hint.
+        if (p.pc.is_global_var() || p.pc.is_region()) {
+            cerr << "False sharing in " << (p.pc.is_region() ? "registered memory with tag " : "global variable ")
+                 << p.pc.inst << (p.pc.is_region() ? "" : " (see mallocGlobals.txt)") << " is not repaired";
+            if (layout.get_new_size() > p.size)
+                cerr << "; padded, it takes " << layout.get_new_size() << " bytes";
+            cerr << endl;
+            continue;
+        }
         const auto &result = layout.get_remapping();
         all_pcs_layout.insert(result.begin(), result.end());
         size_t new_size = layout.get_new_size();
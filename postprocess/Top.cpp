@@ -0,0 +1,103 @@
+// huron-top: shows the contended cache lines a running process publishes
+// with HURON_LIVE (see runtime/LiveTable.h), refreshed in place.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "LiveTable.h"
+
+using namespace std;
+
+void print_usage(const string &arg0) {
+    cerr << arg0 << " pid|shm-name [interval (ms)] [count]" << endl;
+    exit(1);
+}
+
+// Copies the table as it was between two updates.
+static bool read_consistent(const live::Table *shared, live::Table &out) {
+    for (int tries = 0; tries < 1000; tries++) {
+        uint64_t before = shared->seq.load(memory_order_acquire);
+        if (before & 1) {
+            usleep(100);
+            continue;
+        }
+        out.updated_ns = shared->updated_ns;
+        out.pid = shared->pid;
+        out.sampled = shared->sampled;
+        out.dropped = shared->dropped;
+        out.n_lines = min(shared->n_lines, live::MAX_LINES);
+        out.sample_period = shared->sample_period;
+        copy(shared->lines, shared->lines + out.n_lines, out.lines);
+        atomic_thread_fence(memory_order_acquire);
+        if (shared->seq.load(memory_order_relaxed) == before)
+            return true;
+    }
+    return false;
+}
+
+static void print_table(const live::Table &t) {
+    timespec now{};
+    clock_gettime(CLOCK_REALTIME, &now);
+    double age = ((uint64_t) now.tv_sec * 1000000000UL + now.tv_nsec - t.updated_ns) / 1e9;
+    cout << "\033[H\033[2J"
+         << "pid " << t.pid << ", updated " << fixed << setprecision(1) << age << "s ago, "
+         << "1 in " << t.sample_period << " accesses sampled (" << t.sampled << " sampled, "
+         << t.dropped << " dropped)\n\n"
+         << setw(4) << "#" << setw(16) << "line" << setw(7) << "kind" << setw(9) << "threads"
+         << setw(14) << "reads" << setw(14) << "writes" << setw(10) << "malloc" << "  site\n";
+    for (uint32_t i = 0; i < t.n_lines; i++) {
+        const live::Line &l = t.lines[i];
+        cout << setw(4) << i + 1 << "  0x" << hex << setw(12) << setfill('0') << l.addr
+             << setfill(' ') << dec << setw(7) << (l.sharing == live::FALSE_SHARING ? "false" : "true")
+             << setw(9) << l.n_threads << setw(14) << l.reads << setw(14) << l.writes << setw(10);
+        if (l.m_id < 0)
+            cout << "global" << "  -\n";
+        else
+            cout << l.m_id << "  " << (l.site >> 32) << ',' << (uint32_t) l.site << '\n';
+    }
+    cout.flush();
+}
+
+int main(int argc, char *argv[]) {
+    vector<string> args(argv, argv + argc);
+    if (argc < 2 || argc > 4)
+        print_usage(args[0]);
+    char name[64];
+    if (args[1].find_first_not_of("0123456789") == string::npos)
+        live::default_name(name, sizeof(name), stol(args[1]));
+    else
+        snprintf(name, sizeof(name), "%s", args[1].c_str());
+    unsigned interval_ms = argc > 2 ? stoul(args[2]) : 1000;
+    unsigned long count = argc > 3 ? stoul(args[3]) : 0;
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        cerr << "Cannot open " << name << "; is the process running with HURON_LIVE set?" << endl;
+        return 1;
+    }
+    void *mem = mmap(nullptr, sizeof(live::Table), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        cerr << "Cannot map " << name << endl;
+        return 1;
+    }
+    auto *shared = (const live::Table *) mem;
+    if (__atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != live::MAGIC || shared->version != live::VERSION) {
+        cerr << name << " is not a Huron live table" << endl;
+        return 1;
+    }
+    live::Table snapshot{};
+    for (unsigned long i = 0; !count || i < count; i++) {
+        if (i)
+            usleep(interval_ms * 1000);
+        if (read_consistent(shared, snapshot))
+            print_table(snapshot);
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include "Trace.h"
+
+using namespace std;
+
+TracePass::TracePass(const string &in, const vector<string> &rest) : trace_path(in), n_dropped(0) {
+    assert(rest.empty());
+}
+
+void TracePass::compute() {
+    MappedFile mapped(trace_path);
+    auto *p = (const uint8_t *) mapped.data(), *end = p + mapped.size();
+    uint64_t complete_from = 0;
+    size_t n_rings = 0;
+    while (p != end) {
+        trace::RingHeader header{};
+        if ((size_t) (end - p) < sizeof(header))
+            throw invalid_argument("Malformed trace " + trace_path);
+        memcpy((void *) &header, p, sizeof(header));
+        uint64_t written = header.written.load();
+        if (header.magic != trace::MAGIC || header.version > trace::VERSION || !header.capacity ||
+            (size_t) (end - p) < trace::ring_bytes(header.capacity))
+            throw invalid_argument("Malformed trace " + trace_path);
+        auto *events = (const trace::Event *) (p + sizeof(header));
+        p += trace::ring_bytes(header.capacity);
+        n_rings++;
+        // Oldest first: past the end of a wrapped ring is where it goes on.
+        uint64_t n = min(written, header.capacity), oldest = written - n;
+        for (uint64_t i = oldest; i < written; i++)
+            accesses.push_back(Access{events[i % header.capacity], header.line_power});
+        if (written > header.capacity)
+            complete_from = max(complete_from, events[oldest % header.capacity].tsc);
+    }
+    // Each ring is in order already.
+    stable_sort(accesses.begin(), accesses.end(), [](const Access &lhs, const Access &rhs) {
+        return lhs.event.tsc < rhs.event.tsc;
+    });
+    auto first = lower_bound(accesses.begin(), accesses.end(), complete_from,
+                             [](const Access &a, uint64_t tsc) { return a.event.tsc < tsc; });
+    n_dropped = first - accesses.begin();
+    accesses.erase(accesses.begin(), first);
+    cout << accesses.size() << " accesses from " << n_rings << " ring(s)";
+    if (n_dropped)
+        cout << "; " << n_dropped << " dropped from before the start of the latest ring";
+    cout << endl;
+}
+
+void TracePass::print_result(const string &out) {
+    ofstream outfile(out);
+    outfile << "# tsc thread address size R|W func inst\n";
+    for (const auto &a: accesses) {
+        const trace::Event &e = a.event;
+        outfile << e.tsc << ' ' << e.thread << " 0x" << hex << e.addr(a.line_power) << dec << ' '
+                << e.size() << ' ' << (e.is_write() ? 'W' : 'R') << ' ' << e.func << ' ' << e.inst << '\n';
+    }
+}
+
+const char *TracePass::optionals = "";
+const size_t TracePass::n_opt = 0;
@@ -0,0 +1,36 @@
+#ifndef POSTPROCESS_TRACE_H
+#define POSTPROCESS_TRACE_H
+
+#include <string>
+#include <vector>
+#include "Utils.h"
+#include "TraceFormat.h"
+
+// Merges the per-slot access rings of trace mode (see runtime/Tracer.h) into
+// one trace ordered by TSC, one access per line:
+//     tsc thread address size R|W func inst
+// A ring that wrapped lost its oldest events, so the merged trace starts
+// where every ring is complete; earlier events are dropped.
+class TracePass {
+public:
+    static const char *optionals;
+    static const size_t n_opt;
+
+    TracePass(const std::string &in, const std::vector<std::string> &rest);
+
+    void compute();
+
+    void print_result(const std::string &out);
+
+private:
+    struct Access {
+        trace::Event event;
+        uint32_t line_power;
+    };
+
+    std::string trace_path;
+    std::vector<Access> accesses;
+    size_t n_dropped;
+};
+
+#endif //POSTPROCESS_TRACE_H
@@ -2,6 +2,10 @@
 // Created by yifanz on 7/29/18.
 //
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "Utils.h"
 
 using namespace std;
@@ -27,3 +31,25 @@ string insert_suffix(const string &path, const string &suffix) {
         return path.substr(0, dot) + suffix + path.substr(dot);
     }
 }
+
+MappedFile::MappedFile(const string &path) : ptr(nullptr), len(0) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw invalid_argument("Can't open file " + path);
+    struct stat st{};
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        len = (size_t) st.st_size;
+        ptr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            throw invalid_argument("Can't map file " + path);
+        }
+        madvise(ptr, len, MADV_SEQUENTIAL);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (ptr)
+        munmap(ptr, len);
+}
@@ -70,6 +70,27 @@ struct PC {
         return PC(max16, max16);
     }
 
+    // The stack or static TLS block of thread `inst` rather than a call site
+    // (FUNC_STACK and FUNC_TLS in the malloc file).
+    bool is_stack() const {
+        return func == (uint16_t) -2;
+    }
+
+    bool is_tls() const {
+        return func == (uint16_t) -3;
+    }
+
+    // Global variable `inst` (FUNC_GLOBAL_VAR in the malloc file).
+    bool is_global_var() const {
+        return func == (uint16_t) -4;
+    }
+
+    // A region or object registered by the program with tag `inst`
+    // (FUNC_REGION).
+    bool is_region() const {
+        return func == (uint16_t) -5;
+    }
+
     friend std::ostream &operator<<(std::ostream &os, const PC &pc) {
         os << pc.func << ' ' << pc.inst;
         return os;
@@ -227,6 +248,30 @@ inline T to_signed(const string_view &str) {
 
 size_t to_address(const string_view &str);
 
+// Read-only memory map of a whole file.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path);
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile();
+
+    const void *data() const {
+        return ptr;
+    }
+
+    size_t size() const {
+        return len;
+    }
+
+private:
+    void *ptr;
+    size_t len;
+};
+
 template<typename T>
 class AllEqual {
 public:
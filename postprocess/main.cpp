@@ -1,5 +1,6 @@
 #include <iostream>
 #include "Repair.h"
+#include "Trace.h"
 
 using namespace std;
 
@@ -7,7 +8,8 @@ void print_usage(const string &arg0) {
     cerr << arg0 << " \"detect\" logfile output " << DetectPass::optionals << endl
          << arg0 << " \"repair\" detectfile output " << RepairPass::optionals << endl
          << arg0 << " \"all\" logfile output " << DetectPass::optionals
-         << " " << RepairPass::optionals << endl;
+         << " " << RepairPass::optionals << endl
+         << arg0 << " \"trace\" tracefile output" << endl;
     exit(1);
 }
 
@@ -38,6 +40,11 @@ int main(int argc, char *argv[]) {
         rpass.compute();
         rpass.print_result(args[3]);
     }
+    else if (subcmd == "trace") {
+        TracePass tpass(args[2], vector<string>(args.begin() + 4, args.end()));
+        tpass.compute();
+        tpass.print_result(args[3]);
+    }
     else print_usage(args[0]);
 
     return 0;
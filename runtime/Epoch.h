@@ -0,0 +1,115 @@
+#ifndef RUNTIME_EPOCH_H
+#define RUNTIME_EPOCH_H
+
+#include <atomic>
+#include <new>
+#include <vector>
+#include <utility>
+#include "LibFuncs.h"
+#include "StableArray.h"
+
+// Quiescent-state based reclamation for structures read on every access.
+// Readers only ever store to their own cache line; writers retire unlinked
+// memory into their own slot and free it once every online reader has passed
+// a quiescent point.
+class EpochDomain {
+    struct Retired {
+        uint64_t epoch;
+        void *ptr;
+    };
+
+    // Epoch 0 means the reader is offline (not started yet, or exited).
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch{0};
+        // Retired by the thread in this slot and not freed yet, from `head`
+        // on. Epochs never decrease along it, so whatever can be freed is at
+        // the front.
+        std::vector<Retired> limbo;
+        size_t head = 0;
+        // Retired since the last reclaim.
+        size_t pending = 0;
+    };
+
+    EpochDomain() = default;
+
+public:
+    static EpochDomain &getInstance() {
+        static char buf[sizeof(EpochDomain)];
+        static auto *theOneTrueObject = new(buf) EpochDomain();
+        return *theOneTrueObject;
+    }
+
+    // Makes slots up to `reader` available; callers serialize among themselves.
+    void add_reader(int reader) {
+        while (slots.size() <= (size_t) reader)
+            slots.emplace_back();
+    }
+
+    // Must be called before the first read of a reader thread.
+    inline void enter(int reader) {
+        Slot &slot = slots[reader];
+        if (slot.epoch.load(std::memory_order_relaxed) == 0) {
+            slot.epoch.store(global.load(), std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    // The reader holds no reference to retired memory after this.
+    inline void quiesce(int reader) {
+        slots[reader].epoch.store(global.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    // Thread is exiting or about to block, stop waiting for it. The next
+    // enter() brings it back.
+    void offline(int reader) {
+        slots[reader].epoch.store(0, std::memory_order_release);
+    }
+
+    // Writer side, from the thread in slot `reader`.
+    // `ptr` must already be unreachable for new readers and come from
+    // __libc_malloc. The writer must hold no other reference to retired
+    // memory: its own slot counts as quiescent here.
+    void retire(int reader, void *ptr) {
+        Slot &slot = slots[reader];
+        slot.limbo.push_back(Retired{global.load(std::memory_order_acquire), ptr});
+        if (++slot.pending >= RECLAIM_BATCH)
+            reclaim(reader);
+    }
+
+private:
+    // Readers that quiesce after the advance have seen everything retired
+    // before it unlinked, so memory retired in an earlier epoch than every
+    // online reader's is free to go. One advance per batch keeps the shared
+    // counter off the retire path.
+    void reclaim(int reader) {
+        Slot &self = slots[reader];
+        self.pending = 0;
+        global.fetch_add(1, std::memory_order_seq_cst);
+        // Otherwise a writer retiring many entries in one operation (freeing
+        // a block of many pages) would wait on itself.
+        quiesce(reader);
+        uint64_t min_seen = ~0LU;
+        for (size_t i = 0, n = slots.size(); i < n; i++) {
+            uint64_t e = slots[i].epoch.load(std::memory_order_acquire);
+            if (e && e < min_seen)
+                min_seen = e;
+        }
+        std::vector<Retired> &limbo = self.limbo;
+        while (self.head < limbo.size() && limbo[self.head].epoch < min_seen)
+            __libc_free(limbo[self.head++].ptr);
+        if (self.head == limbo.size()) {
+            limbo.clear();
+            self.head = 0;
+        } else if (self.head * 2 >= limbo.size()) {
+            limbo.erase(limbo.begin(), limbo.begin() + self.head);
+            self.head = 0;
+        }
+    }
+
+    static const size_t RECLAIM_BATCH = 64;
+
+    StableArray<Slot> slots;
+    alignas(64) std::atomic<uint64_t> global{1};
+};
+
+#endif //RUNTIME_EPOCH_H
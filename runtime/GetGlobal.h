@@ -1,71 +1,224 @@
+#ifndef RUNTIME_GETGLOBAL_H
+#define RUNTIME_GETGLOBAL_H
+
+#include <algorithm>
+#include <cstdio>
 #include <cstdlib>
-#include <fstream>
+#include <cstring>
+#include <new>
 #include <string>
-#include <iostream>
+#include <vector>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "LogFormat.h"
 #include "Segment.h"
 
-// We may use a inode attribute to analyze whether we need to do this.
-void getRegionInfo(std::string &curentry, uintptr_t *start, uintptr_t *end) {
-    using namespace std;
-    // Now this entry is about globals of libc.so.
-    string::size_type pos = 0;
-    string::size_type endpos = 0;
-    // Get the starting address and end address of this entry.
-    // Normally the entry will be like this
-    // "00797000-00798000 rw-p ...."
-    string beginstr, endstr;
-
-    while (curentry[pos] != '-')
-        pos++;
-
-    beginstr = curentry.substr(0, pos);
-
-    // Skip the '-' character
-    pos++;
-    endpos = pos;
-
-    // Now pos should point to a space or '\t'.
-    while (!isspace(curentry[pos]))
-        pos++;
-    endstr = curentry.substr(endpos, pos - endpos);
-
-    // Save this entry to the passed regions.
-    *start = strtoul(beginstr.c_str(), nullptr, 16);
-    *end = strtoul(endstr.c_str(), nullptr, 16);
-
-}
-
-// Trying to get information about global regions.
-AddrSeg getGlobalRegion() {
-    using namespace std;
-    ifstream iMapfile;
-    string curentry;
-
-    try {
-        iMapfile.open("/proc/self/maps");
-    } catch (...) {
-        fprintf(stderr, "can't open /proc/self/maps, exit now\n");
-        abort();
+// The writable segments (data and bss) of the loaded modules, and the global
+// variables in them, from each module's ELF symbol table (.symtab, or
+// .dynsym in stripped files). Variable k is a region of its own, logged with
+// M_ID -2 - k; bytes no symbol covers belong to the global segment, M_ID -1.
+// Only the executable is tracked by default. Tracking the shared libraries
+// as well makes the bounds of the inline global check span the mappings
+// between them and the executable, heap and thread stacks among them, so
+// instrumented code then calls into the runtime for most accesses.
+class GlobalSymbols {
+    struct Module {
+        std::string name;
+        // Writable PT_LOAD segments, as [start, end).
+        std::vector<AddrSeg> segs;
+    };
+
+    struct Var {
+        uintptr_t start;
+        size_t size;
+        // Offset of the name in `names`, and owning module.
+        uint32_t name, module;
+
+        bool operator<(const Var &rhs) const {
+            return start < rhs.start || (start == rhs.start && size > rhs.size);
+        }
+    };
+
+    // Variable numbers go to the Instrumenter id field of the malloc file,
+    // 16 bits wide after detection.
+    static const size_t MAX_VARS = 1 << 16;
+
+    GlobalSymbols() : all_modules(false) {}
+
+public:
+    static GlobalSymbols &getInstance() {
+        static char buf[sizeof(GlobalSymbols)];
+        static auto *theOneTrueObject = new(buf) GlobalSymbols();
+        return *theOneTrueObject;
     }
 
-    // Now we analyze each line of this maps file.
-    uintptr_t startaddr, endaddr;
-    string nextentry;
-
-    while (getline(iMapfile, curentry)) {
-        // Check the globals for the application. It is at the first entry
-        if (((curentry.find(" rw-p ", 0) != string::npos) ||
-             (curentry.find(" rwxp ", 0) != string::npos))) {
-            // Now it is start of global of applications
-            getRegionInfo(curentry, &startaddr, &endaddr);
-
-            getline(iMapfile, nextentry);
-            uintptr_t newstart, newend;
-            if (nextentry.find("lib") != string::npos && (nextentry.find(" rw-p ") == string::npos))
-                return AddrSeg(0, 0);
-            getRegionInfo(nextentry, &newstart, &newend);
-            return AddrSeg(startaddr, (newstart == endaddr ? newend : endaddr));
+    // HURON_GLOBALS=all also tracks the globals of the shared libraries.
+    // Called before any hook is active.
+    void init_from_env() {
+        const char *env = getenv("HURON_GLOBALS");
+        all_modules = env && !strcmp(env, "all");
+        dl_iterate_phdr(add_module, this);
+        std::sort(segs.begin(), segs.end(), [](const AddrSeg &a, const AddrSeg &b) {
+            return a.get_start() < b.get_start();
+        });
+        std::sort(vars.begin(), vars.end());
+        // Aliases and symbols nested in others fold into the first one.
+        size_t kept = 0;
+        for (size_t i = 0; i < vars.size(); i++)
+            if (!kept || vars[i].start >= vars[kept - 1].start + vars[kept - 1].size)
+                vars[kept++] = vars[i];
+        vars.resize(kept);
+        if (vars.size() > MAX_VARS) {
+            fprintf(stderr, "%lu global variables, only the first %lu are told apart!!\n",
+                    vars.size(), MAX_VARS);
+            vars.resize(MAX_VARS);
         }
+#ifdef DEBUG
+        printf("%lu writable segments, %lu global variables;\n", segs.size(), vars.size());
+#endif
     }
-    return AddrSeg(0, 0);  // info not found
-}
+
+    // Smallest range covering every tracked segment.
+    AddrSeg bounds() const {
+        if (segs.empty())
+            return AddrSeg(0, 0);
+        uintptr_t end = 0;
+        for (const AddrSeg &seg: segs)
+            end = std::max(end, seg.get_end());
+        return AddrSeg(segs.front().get_start(), end);
+    }
+
+    // For an address in a tracked segment, `var` is 0 if no variable covers
+    // it and k + 1 for variable k, and `offset` is the offset in it.
+    inline bool find(uintptr_t addr, uint32_t &var, uint32_t &offset) const {
+        auto seg = std::upper_bound(segs.begin(), segs.end(), addr, [](uintptr_t a, const AddrSeg &s) {
+            return a < s.get_start();
+        });
+        if (seg == segs.begin() || addr >= (seg - 1)->get_end())
+            return false;
+        auto it = std::upper_bound(vars.begin(), vars.end(), addr, [](uintptr_t a, const Var &v) {
+            return a < v.start;
+        });
+        if (it != vars.begin() && addr < (it - 1)->start + (it - 1)->size) {
+            var = (uint32_t) (it - vars.begin());
+            offset = (uint32_t) (addr - (it - 1)->start);
+        } else
+            var = offset = 0;
+        return true;
+    }
+
+    // One MALLOCS row per variable.
+    void dump_rows(logfmt::BlockWriter &block) const {
+        using namespace logfmt;
+        for (size_t k = 0; k < vars.size(); k++) {
+            block[M_ID].put_signed(-2 - (int64_t) k);
+            block[M_START].put_delta(vars[k].start);
+            block[M_SIZE].put(vars[k].size);
+            block[M_FUNC].put_signed(FUNC_GLOBAL_VAR);
+            block[M_INST].put_signed((int64_t) k);
+            block[M_THREAD].put_signed(-1);
+            block[M_STACK].put(0);
+            block.end_row();
+        }
+    }
+
+    // Writes "k name module" for each variable k.
+    void dump_names(const char *path) const {
+        FILE *file = fopen(path, "w");
+        if (!file) {
+            fprintf(stderr, "Cannot open file!!\n");
+            return;
+        }
+        for (size_t k = 0; k < vars.size(); k++)
+            fprintf(file, "%lu %s %s\n", k, names.c_str() + vars[k].name, modules[vars[k].module].name.c_str());
+        fclose(file);
+    }
+
+private:
+    static int add_module(dl_phdr_info *info, size_t, void *data) {
+        auto *self = (GlobalSymbols *) data;
+        // The executable comes first, with an empty name.
+        bool is_exe = self->modules.empty();
+        if (!is_exe && !self->all_modules)
+            return 1;
+        Module mod;
+        for (int i = 0; i < info->dlpi_phnum; i++) {
+            const ElfW(Phdr) &ph = info->dlpi_phdr[i];
+            if (ph.p_type == PT_LOAD && (ph.p_flags & PF_W) && ph.p_memsz)
+                mod.segs.emplace_back(info->dlpi_addr + ph.p_vaddr, info->dlpi_addr + ph.p_vaddr + ph.p_memsz);
+        }
+        if (is_exe) {
+            char path[4096];
+            ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+            mod.name = len > 0 ? std::string(path, (size_t) len) : "exe";
+        } else
+            mod.name = info->dlpi_name;
+        // Files we cannot read (the vDSO) still have their segments tracked.
+        self->read_symbols(is_exe ? "/proc/self/exe" : info->dlpi_name, info->dlpi_addr, mod,
+                           (uint32_t) self->modules.size());
+        self->segs.insert(self->segs.end(), mod.segs.begin(), mod.segs.end());
+        self->modules.push_back(std::move(mod));
+        return 0;
+    }
+
+    // Adds the data objects of `mod` defined in its writable segments.
+    void read_symbols(const char *path, uintptr_t base, const Module &mod, uint32_t mod_index) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st{};
+        void *mem = fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(ElfW(Ehdr)) ?
+                    mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (mem == MAP_FAILED)
+            return;
+        auto *file = (const char *) mem;
+        auto size = (size_t) st.st_size;
+        auto *ehdr = (const ElfW(Ehdr) *) file;
+        if (!memcmp(ehdr->e_ident, ELFMAG, SELFMAG) && ehdr->e_shoff &&
+            ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr)) <= size) {
+            auto *shdrs = (const ElfW(Shdr) *) (file + ehdr->e_shoff);
+            const ElfW(Shdr) *symtab = nullptr;
+            for (int i = 0; i < ehdr->e_shnum; i++)
+                if (shdrs[i].sh_type == SHT_SYMTAB || (shdrs[i].sh_type == SHT_DYNSYM && !symtab))
+                    symtab = &shdrs[i];
+            if (symtab && symtab->sh_link < ehdr->e_shnum && symtab->sh_offset + symtab->sh_size <= size) {
+                const ElfW(Shdr) &strtab = shdrs[symtab->sh_link];
+                auto *syms = (const ElfW(Sym) *) (file + symtab->sh_offset);
+                size_t n = symtab->sh_size / sizeof(ElfW(Sym));
+                for (size_t i = 0; i < n; i++) {
+                    const ElfW(Sym) &sym = syms[i];
+                    if (ELF64_ST_TYPE(sym.st_info) != STT_OBJECT || !sym.st_size ||
+                        sym.st_shndx == SHN_UNDEF || sym.st_shndx == SHN_ABS || sym.st_name >= strtab.sh_size ||
+                        strtab.sh_offset + strtab.sh_size > size)
+                        continue;
+                    uintptr_t start = base + sym.st_value;
+                    bool writable = false;
+                    for (const AddrSeg &seg: mod.segs)
+                        writable |= start >= seg.get_start() && start + sym.st_size <= seg.get_end();
+                    if (!writable)
+                        continue;
+                    const char *name = file + strtab.sh_offset + sym.st_name;
+                    vars.push_back(Var{start, sym.st_size, (uint32_t) names.size(), mod_index});
+                    names.append(name, strnlen(name, strtab.sh_size - sym.st_name));
+                    names.push_back('\0');
+                }
+            }
+        }
+        munmap(mem, size);
+    }
+
+    bool all_modules;
+    std::vector<Module> modules;
+    // Sorted by start.
+    std::vector<AddrSeg> segs;
+    std::vector<Var> vars;
+    // NUL-separated.
+    std::string names;
+};
+
+#endif //RUNTIME_GETGLOBAL_H
@@ -0,0 +1,201 @@
+#ifndef RUNTIME_HEAVYHITTERS_H
+#define RUNTIME_HEAVYHITTERS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "LoggingThread.h"
+
+// Bounded-memory replacement for a thread's LocTable: a space-saving table
+// keeps the (address, PC, allocation) keys with the highest access counts.
+// A newly tracked key takes the place, and the count, of the smallest one;
+// the evicted count bounds how often the new key was seen before, and a
+// count-min sketch of all accesses gives a second bound that is often
+// tighter. Nothing is written until the thread stops, and then only the
+// tracked keys, each with the accesses its counts may have missed:
+//     r + w <= true count <= r + w + err.
+// Keys are not whole cache lines: detection needs the addresses within a
+// line to tell true from false sharing, and judges contention itself across
+// the threads' top keys.
+class HeavyHitters {
+    struct Counter {
+        LocRecord rec;
+        // Accesses seen while tracked.
+        uint64_t r, w;
+        // Space-saving count, which orders the table: r + w + the evicted count.
+        uint64_t count, err;
+        // coarse_time of the first and last access seen while tracked.
+        uint64_t first, last;
+    };
+
+    static const int SKETCH_DEPTH = 4;
+
+public:
+    // Splits `budget` bytes between the table and the sketch.
+    explicit HeavyHitters(size_t budget) : n(0) {
+        size_t per_counter = sizeof(Counter) + 2 * sizeof(uint32_t) + 2 * sizeof(uint32_t);
+        capacity = std::max<size_t>(budget / 2 / per_counter, 1);
+        size_t cap = 1;
+        while (cap < 2 * capacity)
+            cap <<= 1;
+        index_mask = cap - 1;
+        width_bits = 1;
+        while ((SKETCH_DEPTH * sizeof(uint64_t) << (width_bits + 1)) <= budget / 2)
+            width_bits++;
+        counters = new Counter[capacity];
+        heap = new uint32_t[capacity];
+        heap_pos = new uint32_t[capacity];
+        index = new uint32_t[cap]();
+        sketch = new uint64_t[SKETCH_DEPTH << width_bits]();
+    }
+
+    ~HeavyHitters() {
+        delete[] counters;
+        delete[] heap;
+        delete[] heap_pos;
+        delete[] index;
+        delete[] sketch;
+    }
+
+    HeavyHitters(const HeavyHitters &) = delete;
+
+    HeavyHitters &operator=(const HeavyHitters &) = delete;
+
+    // HURON_HH_BUDGET=<bytes>[K|M|G] per thread enables the mode; 0 if unset.
+    static size_t budget_from_env() {
+        const char *env = getenv("HURON_HH_BUDGET");
+        if (!env)
+            return 0;
+        char *end;
+        size_t budget = strtoul(env, &end, 10);
+        switch (*end) {
+            case 'G': case 'g': budget <<= 10; // fall through
+            case 'M': case 'm': budget <<= 10; // fall through
+            case 'K': case 'k': budget <<= 10; break;
+            default: break;
+        }
+        return budget;
+    }
+
+    void add(const LocRecord &rec, bool is_write, uint64_t now) {
+        uint64_t h = hash(rec);
+        uint64_t estimate = count_sketch(h);
+        size_t i = h & index_mask;
+        for (; index[i]; i = (i + 1) & index_mask) {
+            Counter &c = counters[index[i] - 1];
+            if (c.rec.same_key(rec)) {
+                (is_write ? c.w : c.r)++;
+                c.count++;
+                c.last = now;
+                sift_down(heap_pos[index[i] - 1]);
+                return;
+            }
+        }
+        uint32_t k;
+        uint64_t prior = 0, err = 0;
+        if (n < capacity) {
+            k = (uint32_t) n++;
+            heap[k] = k;
+            heap_pos[k] = k;
+        } else {
+            // Evict the smallest count. The new key cannot have been seen more
+            // often than that, nor more often than the sketch says.
+            k = heap[0];
+            prior = counters[k].count;
+            err = std::min(prior, estimate - 1);
+            remove_index(counters[k].rec);
+            // The removal may have shifted entries across our empty slot.
+            for (i = h & index_mask; index[i]; i = (i + 1) & index_mask);
+        }
+        counters[k] = Counter{rec, is_write ? 0UL : 1UL, is_write ? 1UL : 0UL, prior + 1, err, now, now};
+        index[i] = k + 1;
+        sift_up(heap_pos[k]);
+        sift_down(heap_pos[k]);
+    }
+
+    // Emits every tracked key and starts over.
+    template<typename EmitT>
+    void drain(EmitT emit) {
+        for (size_t k = 0; k < n; k++)
+            emit(LogEntry{counters[k].rec, counters[k].r, counters[k].w, counters[k].err,
+                          counters[k].first, counters[k].last});
+        n = 0;
+        memset(index, 0, (index_mask + 1) * sizeof(uint32_t));
+        memset(sketch, 0, (SKETCH_DEPTH * sizeof(uint64_t)) << width_bits);
+    }
+
+private:
+    static uint64_t hash(const LocRecord &rec) {
+        uint64_t h = rec.hash();
+        return h ^ (h >> 29);
+    }
+
+    // Adds one access of the key and returns its estimated count.
+    uint64_t count_sketch(uint64_t h) {
+        static const uint64_t seeds[SKETCH_DEPTH] = {
+                0x9e3779b97f4a7c15UL, 0xc2b2ae3d27d4eb4fUL, 0x165667b19e3779f9UL, 0xd6e8feb86659fd93UL};
+        uint64_t estimate = ~0UL;
+        for (int d = 0; d < SKETCH_DEPTH; d++) {
+            uint64_t &cell = sketch[((size_t) d << width_bits) + ((h * seeds[d]) >> (64 - width_bits))];
+            estimate = std::min(estimate, ++cell);
+        }
+        return estimate;
+    }
+
+    // Backward-shift deletion, as in LocTable.
+    void remove_index(const LocRecord &rec) {
+        size_t i = hash(rec) & index_mask;
+        while (!counters[index[i] - 1].rec.same_key(rec))
+            i = (i + 1) & index_mask;
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & index_mask;
+            if (!index[j])
+                break;
+            size_t home = hash(counters[index[j] - 1].rec) & index_mask;
+            bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+            if (stays)
+                continue;
+            index[i] = index[j];
+            i = j;
+        }
+        index[i] = 0;
+    }
+
+    // Min-heap of counter indices by count.
+    void swap_heap(size_t a, size_t b) {
+        std::swap(heap[a], heap[b]);
+        heap_pos[heap[a]] = (uint32_t) a;
+        heap_pos[heap[b]] = (uint32_t) b;
+    }
+
+    void sift_up(size_t i) {
+        while (i && counters[heap[(i - 1) / 2]].count > counters[heap[i]].count) {
+            swap_heap(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void sift_down(size_t i) {
+        while (true) {
+            size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+            if (l < n && counters[heap[l]].count < counters[heap[min]].count)
+                min = l;
+            if (r < n && counters[heap[r]].count < counters[heap[min]].count)
+                min = r;
+            if (min == i)
+                return;
+            swap_heap(i, min);
+            i = min;
+        }
+    }
+
+    Counter *counters;
+    uint32_t *heap, *heap_pos, *index;
+    uint64_t *sketch;
+    size_t n, capacity, index_mask;
+    int width_bits;
+};
+
+#endif //RUNTIME_HEAVYHITTERS_H
@@ -5,28 +5,60 @@
 #ifndef RUNTIME_LIBFUNCS_H
 #define RUNTIME_LIBFUNCS_H
 
+#include <cerrno>
 #include <cstdio>
 #include <dlfcn.h>
 #include <zconf.h>
 #include <cstdlib>
 #include <cassert>
 
+// The real pthread_create, also used for the runtime's own threads. Fails
+// with EAGAIN if it cannot be found, rather than exiting.
 int __internal_pthread_create(pthread_t *t1, const pthread_attr_t *t2,
                               void *(*t3)(void *), void *t4) {
     typedef int (*p_create_t)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *);
     static p_create_t _pthread_create_ptr;
     if (_pthread_create_ptr == nullptr) {
-        void *lib_handle = dlopen("libpthread.so.0", RTLD_NOW | RTLD_GLOBAL | RTLD_NOLOAD);
-        if (lib_handle == nullptr) {
-            fprintf(stderr, "Unable to load libpthread.so.0\n");
-            exit(2);
+        _pthread_create_ptr = (p_create_t) dlsym(RTLD_NEXT, "pthread_create");
+        if (_pthread_create_ptr == nullptr) {
+            fprintf(stderr, "Cannot find pthread_create!!\n");
+            return EAGAIN;
         }
-        _pthread_create_ptr = (p_create_t) dlsym(lib_handle, "pthread_create");
-        assert(_pthread_create_ptr);
     }
     return _pthread_create_ptr(t1, t2, t3, t4);
 }
 
+[[noreturn]] void __internal_pthread_exit(void *retval) {
+    typedef void (*p_exit_t)(void *);
+    static p_exit_t _pthread_exit_ptr;
+    if (_pthread_exit_ptr == nullptr) {
+        _pthread_exit_ptr = (p_exit_t) dlsym(RTLD_NEXT, "pthread_exit");
+        assert(_pthread_exit_ptr);
+    }
+    _pthread_exit_ptr(retval);
+    __builtin_unreachable();
+}
+
+int __internal_pthread_join(pthread_t thread, void **retval) {
+    typedef int (*p_join_t)(pthread_t, void **);
+    static p_join_t _pthread_join_ptr;
+    if (_pthread_join_ptr == nullptr) {
+        _pthread_join_ptr = (p_join_t) dlsym(RTLD_NEXT, "pthread_join");
+        assert(_pthread_join_ptr);
+    }
+    return _pthread_join_ptr(thread, retval);
+}
+
+int __internal_pthread_barrier_wait(pthread_barrier_t *barrier) {
+    typedef int (*p_barrier_wait_t)(pthread_barrier_t *);
+    static p_barrier_wait_t _pthread_barrier_wait_ptr;
+    if (_pthread_barrier_wait_ptr == nullptr) {
+        _pthread_barrier_wait_ptr = (p_barrier_wait_t) dlsym(RTLD_NEXT, "pthread_barrier_wait");
+        assert(_pthread_barrier_wait_ptr);
+    }
+    return _pthread_barrier_wait_ptr(barrier);
+}
+
 int __internal_posix_memalign(void **memptr, size_t alignment, size_t size) {
     typedef int (*posix_memalign_t)(void **, size_t, size_t);
     static posix_memalign_t _posix_memalign_ptr;
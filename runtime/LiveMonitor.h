@@ -0,0 +1,270 @@
+#ifndef RUNTIME_LIVEMONITOR_H
+#define RUNTIME_LIVEMONITOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "LibFuncs.h"
+#include "LiveTable.h"
+#include "MemArith.h"
+#include "StableArray.h"
+
+// Publishes the most contended cache lines of a running process into POSIX
+// shared memory (see LiveTable.h), for huron-top to show.
+// One in `period` logged accesses of each thread goes into the ring of its
+// thread slot; the ring is single-producer single-consumer and drops events
+// when full, so application threads never wait. A background aggregator
+// drains the rings, keeps decaying per-line counts, and rewrites the table.
+class LiveMonitor {
+    struct Event {
+        uintptr_t addr;
+        uint64_t site;
+        int32_t m_id;
+        uint32_t thread;
+        bool is_write;
+    };
+
+    struct Ring {
+        static const size_t LEN = 1 << 12;
+        alignas(64) std::atomic<uint64_t> head{0};
+        alignas(64) std::atomic<uint64_t> tail{0};
+        std::atomic<uint64_t> dropped{0};
+        Event events[LEN];
+    };
+
+    // Threads using a cache line, by thread id modulo 64.
+    struct Users {
+        uint64_t threads, writers;
+        // Threads using each 4-byte word of the line.
+        uint64_t word_threads[(1 << cacheline_size_power) / 4];
+
+        void merge(const Users &rhs) {
+            threads |= rhs.threads, writers |= rhs.writers;
+            for (size_t i = 0; i < sizeof(word_threads) / sizeof(word_threads[0]); i++)
+                word_threads[i] |= rhs.word_threads[i];
+        }
+    };
+
+    // A cache line as seen by the aggregator.
+    struct LineStat {
+        uint64_t reads, writes;
+        // Users in the current publish window and in the one before; older
+        // ones are forgotten, like the counts.
+        Users users, prev_users;
+        int64_t m_id;
+        uint64_t site;
+    };
+
+    static const int DRAIN_MS = 10, PUBLISH_MS = 1000;
+
+    LiveMonitor() : table(nullptr), period(64), running(false), stopping(false), thread() {
+        name[0] = '\0';
+    }
+
+public:
+    static LiveMonitor &getInstance() {
+        static char buf[sizeof(LiveMonitor)];
+        static auto *theOneTrueObject = new(buf) LiveMonitor();
+        return *theOneTrueObject;
+    }
+
+    // HURON_LIVE=1 publishes to /huron.<pid>, any other value names the
+    // segment; HURON_LIVE_SAMPLE=<N> samples one in N logged accesses.
+    void init_from_env() {
+        const char *env = getenv("HURON_LIVE");
+        if (!env || !*env || !strcmp(env, "0"))
+            return;
+        if (!strcmp(env, "1"))
+            live::default_name(name, sizeof(name), (long) getpid());
+        else
+            snprintf(name, sizeof(name), "%s", env);
+        if (const char *sample = getenv("HURON_LIVE_SAMPLE"))
+            period = std::max((uint32_t) strtoul(sample, nullptr, 10), 1U);
+        int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(live::Table)) != 0) {
+            fprintf(stderr, "Cannot create live table %s!!\n", name);
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+        void *mem = mmap(nullptr, sizeof(live::Table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "Cannot map live table %s!!\n", name);
+            shm_unlink(name);
+            return;
+        }
+        auto *t = (live::Table *) mem;
+        t->version = live::VERSION;
+        t->pid = (uint64_t) getpid();
+        t->sample_period = period;
+        // Readers check the magic last.
+        __atomic_store_n(&t->magic, live::MAGIC, __ATOMIC_RELEASE);
+        table = t;
+        running = __internal_pthread_create(&thread, nullptr, run, this) == 0;
+        if (!running)
+            fprintf(stderr, "Cannot start live monitor!!\n");
+    }
+
+    inline bool enabled() const {
+        return running;
+    }
+
+    // Stops the aggregator and removes the table.
+    void stop() {
+        if (!running)
+            return;
+        stopping.store(true);
+        pthread_join(thread, nullptr);
+        running = false;
+        munmap(table, sizeof(live::Table));
+        shm_unlink(name);
+    }
+
+    // Called for every logged access of the thread in `slot`.
+    inline void record(int slot, int thread, uintptr_t addr, int64_t m_id, uint64_t site, bool is_write) {
+        static __thread uint32_t countdown;
+        if (countdown) {
+            countdown--;
+            return;
+        }
+        countdown = period - 1;
+        Ring &ring = ring_of(slot);
+        uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        if (tail - ring.head.load(std::memory_order_acquire) >= Ring::LEN) {
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        ring.events[tail % Ring::LEN] = Event{addr, site, (int32_t) m_id, (uint32_t) thread, is_write};
+        ring.tail.store(tail + 1, std::memory_order_release);
+    }
+
+private:
+    Ring &ring_of(int slot) {
+        if ((size_t) slot >= rings.size()) {
+            std::lock_guard<std::mutex> lg(lock);
+            while (rings.size() <= (size_t) slot)
+                rings.emplace_back();
+        }
+        return rings[slot];
+    }
+
+    static void *run(void *arg) {
+        auto *self = (LiveMonitor *) arg;
+        std::unordered_map<uintptr_t, LineStat> lines;
+        uint64_t sampled = 0;
+        for (int waited = 0; !self->stopping.load(); waited += DRAIN_MS) {
+            usleep(DRAIN_MS * 1000);
+            sampled += self->drain(lines);
+            if (waited >= PUBLISH_MS) {
+                self->publish(lines, sampled);
+                waited = 0;
+            }
+        }
+        return nullptr;
+    }
+
+    uint64_t drain(std::unordered_map<uintptr_t, LineStat> &lines) {
+        uint64_t n = 0;
+        for (size_t i = 0; i < rings.size(); i++) {
+            Ring &ring = rings[i];
+            uint64_t head = ring.head.load(std::memory_order_relaxed);
+            uint64_t tail = ring.tail.load(std::memory_order_acquire);
+            for (; head != tail; head++, n++) {
+                const Event &e = ring.events[head % Ring::LEN];
+                uint64_t bit = 1UL << (e.thread % 64);
+                auto it = lines.find(e.addr >> cacheline_size_power);
+                if (it == lines.end()) {
+                    LineStat fresh{};
+                    fresh.m_id = e.m_id;
+                    fresh.site = e.site;
+                    it = lines.emplace(e.addr >> cacheline_size_power, fresh).first;
+                }
+                // A line shared by several allocations is shown with the first.
+                LineStat &st = it->second;
+                (e.is_write ? st.writes : st.reads)++;
+                st.users.threads |= bit;
+                if (e.is_write)
+                    st.users.writers |= bit;
+                st.users.word_threads[(e.addr & ((1 << cacheline_size_power) - 1)) / 4] |= bit;
+            }
+            ring.head.store(head, std::memory_order_release);
+        }
+        return n;
+    }
+
+    // Writes the lines touched by several threads over the last two windows,
+    // at least one of them writing, in order of accesses; then halves every
+    // count and ages the users, so the table follows the load.
+    void publish(std::unordered_map<uintptr_t, LineStat> &lines, uint64_t sampled) {
+        std::vector<std::pair<uint64_t, uintptr_t>> hot;
+        for (const auto &p: lines) {
+            Users users = p.second.users;
+            users.merge(p.second.prev_users);
+            if (__builtin_popcountl(users.threads) >= 2 && users.writers)
+                hot.emplace_back(p.second.reads + p.second.writes, p.first);
+        }
+        size_t n = std::min<size_t>(hot.size(), live::MAX_LINES);
+        std::partial_sort(hot.begin(), hot.begin() + n, hot.end(), std::greater<std::pair<uint64_t, uintptr_t>>());
+        uint64_t dropped = 0;
+        for (size_t i = 0; i < rings.size(); i++)
+            dropped += rings[i].dropped.load(std::memory_order_relaxed);
+        timespec now{};
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        uint64_t seq = table->seq.load(std::memory_order_relaxed);
+        table->seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < n; i++) {
+            const LineStat &st = lines[hot[i].second];
+            Users users = st.users;
+            users.merge(st.prev_users);
+            bool shared_word = false;
+            for (uint64_t word_users: users.word_threads)
+                shared_word |= __builtin_popcountl(word_users) >= 2;
+            table->lines[i] = live::Line{hot[i].second << cacheline_size_power, st.reads * period,
+                                         st.writes * period, st.m_id, st.site,
+                                         (uint32_t) __builtin_popcountl(users.threads),
+                                         shared_word ? live::TRUE_SHARING : live::FALSE_SHARING};
+        }
+        table->n_lines = (uint32_t) n;
+        table->sampled = sampled;
+        table->dropped = dropped;
+        table->updated_ns = (uint64_t) now.tv_sec * 1000000000UL + now.tv_nsec;
+        table->seq.store(seq + 2, std::memory_order_release);
+
+        for (auto it = lines.begin(); it != lines.end();) {
+            LineStat &st = it->second;
+            st.reads /= 2, st.writes /= 2;
+            st.prev_users = st.users;
+            st.users = Users{};
+            if (!st.reads && !st.writes)
+                it = lines.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    live::Table *table;
+    char name[64];
+    uint32_t period;
+    StableArray<Ring> rings;
+    // Only taken to add rings, once per thread slot.
+    std::mutex lock;
+    bool running;
+    std::atomic<bool> stopping;
+    pthread_t thread;
+};
+
+#endif //RUNTIME_LIVEMONITOR_H
@@ -0,0 +1,59 @@
+#ifndef RUNTIME_LIVETABLE_H
+#define RUNTIME_LIVETABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+// Layout of the shared-memory table published by the runtime's live monitor
+// (HURON_LIVE) and shown by huron-top: the most contended cache lines of the
+// last few seconds, rewritten in place by a single writer.
+//
+// Readers copy `lines` between two reads of `seq` and retry if it changed or
+// was odd (a write was in progress), so neither side ever takes a lock.
+namespace live {
+
+const uint32_t MAGIC = 0x4c525548;  // "HURL"
+const uint32_t VERSION = 1;
+const uint32_t MAX_LINES = 64;
+
+enum Sharing : uint32_t {
+    // Some word of the line is used by more than one thread.
+    TRUE_SHARING = 0,
+    // The threads use disjoint words of the line.
+    FALSE_SHARING = 1
+};
+
+struct Line {
+    // Cache line address.
+    uint64_t addr;
+    // Accesses in the window, extrapolated from the sampled ones.
+    uint64_t reads, writes;
+    // Allocation holding the line, -1 for globals, and its call site
+    // (Instrumenter func << 32 | inst).
+    int64_t m_id;
+    uint64_t site;
+    uint32_t n_threads;
+    uint32_t sharing;
+};
+
+struct Table {
+    uint32_t magic, version;
+    std::atomic<uint64_t> seq;
+    // CLOCK_REALTIME of the last update, in ns.
+    uint64_t updated_ns;
+    uint64_t pid;
+    // Accesses sampled, and dropped because the aggregator fell behind, so far.
+    uint64_t sampled, dropped;
+    uint32_t n_lines, sample_period;
+    Line lines[MAX_LINES];
+};
+
+// POSIX shared-memory name of the table of process `pid`.
+inline void default_name(char *buf, size_t len, long pid) {
+    snprintf(buf, len, "/huron.%ld", pid);
+}
+
+}
+
+#endif //RUNTIME_LIVETABLE_H
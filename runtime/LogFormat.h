@@ -0,0 +1,287 @@
+#ifndef RUNTIME_LOGFORMAT_H
+#define RUNTIME_LOGFORMAT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Binary columnar format of record.log and mallocRuntimeIDs.txt, written by
+// the runtime and read back by postprocess.
+//
+// A file is a sequence of self-contained blocks, so that per-thread files can
+// simply be concatenated. A block is a BlockHeader, `n_cols` column lengths in
+// bytes (uint64_t each), then the columns back to back. A column holds one
+// LEB128 varint per row; signed columns are zigzag-encoded and delta columns
+// store the zigzag-encoded difference to the previous row of the block.
+// Readers give columns missing from a block their default (0), and skip
+// columns they do not know about, so columns can be appended in later versions.
+//
+// The per-thread logs are merged into record.log as a container: a
+// ContainerHeader, `n_segments` SegmentEntry, then the segments, each being
+// the blocks of one thread slot (i.e. of the threads that ran in it one after
+// another). Readers can locate (and decode) every segment independently.
+namespace logfmt {
+
+const uint32_t MAGIC = 0x4e525548;  // "HURN"
+const uint32_t CONTAINER_MAGIC = 0x43525548;  // "HURC"
+const uint16_t VERSION = 1;
+
+enum Kind : uint16_t {
+    RECORDS = 1, MALLOCS = 2, META = 3, THREADS = 4
+};
+
+// Columns of a RECORDS block, in order.
+enum RecordCol {
+    R_THREAD, R_ADDR /* delta */, R_M_ID /* signed, -1: global */, R_M_OFFSET,
+    R_FUNC, R_INST, R_SIZE, R_READS, R_WRITES,
+    R_ERROR /* the true count is at most reads + writes + this */,
+    R_PHASE /* barrier rounds completed before the accesses */,
+    R_FIRST /* delta, coarse TSC of the first access, 0: unknown */, R_SPAN /* coarse TSC of the last one - R_FIRST */,
+    R_NCOLS
+};
+
+// Columns of a MALLOCS block, in order.
+enum MallocCol {
+    M_ID /* signed, -1: global segment, -2 - k: global variable k */, M_START /* delta */, M_SIZE,
+    M_FUNC /* signed, see below */, M_INST /* signed */, M_THREAD /* signed, -1: global */,
+    M_STACK /* hash of the frames above the call site, 0: none */, M_NCOLS
+};
+
+// M_FUNC of rows that are not allocations: the global segment, the stack
+// and static TLS block of thread M_THREAD (see ThreadRegions.h), global
+// variable M_INST (see GetGlobal.h), and a region or object the program
+// registered with tag M_INST (see huron.h).
+const int64_t FUNC_GLOBAL = -1, FUNC_STACK = -2, FUNC_TLS = -3, FUNC_GLOBAL_VAR = -4, FUNC_REGION = -5;
+
+// Columns of the single-row META block about the run, in order.
+enum MetaCol {
+    META_LINE_SAMPLE /* one in this many cache lines was tracked */, META_NCOLS
+};
+
+// Columns of a THREADS block, one row per thread (by id) seen in the run;
+// times are CLOCK_MONOTONIC in ns.
+enum ThreadCol {
+    T_INDEX, T_START, T_END /* 0: still running */, T_NCOLS
+};
+
+struct BlockHeader {
+    uint32_t magic;
+    uint16_t version, kind;
+    uint32_t n_rows, n_cols;
+};
+
+struct ContainerHeader {
+    uint32_t magic;
+    uint16_t version, reserved;
+    uint64_t n_segments;
+};
+
+struct SegmentEntry {
+    // Offset is from the start of the file.
+    uint64_t slot, offset, length;
+};
+
+inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+class ColumnWriter {
+public:
+    inline void put(uint64_t v) {
+        while (v >= 0x80) {
+            buf.push_back((uint8_t) (v | 0x80));
+            v >>= 7;
+        }
+        buf.push_back((uint8_t) v);
+    }
+
+    inline void put_signed(int64_t v) {
+        put(zigzag(v));
+    }
+
+    inline void put_delta(uint64_t v) {
+        put_signed((int64_t) (v - prev));
+        prev = v;
+    }
+
+    const std::vector<uint8_t> &bytes() const {
+        return buf;
+    }
+
+    void clear() {
+        buf.clear();
+        prev = 0;
+    }
+
+private:
+    std::vector<uint8_t> buf;
+    uint64_t prev = 0;
+};
+
+class BlockWriter {
+public:
+    BlockWriter(Kind _kind, size_t n_cols) : cols(n_cols), n_rows(0), kind(_kind) {}
+
+    inline ColumnWriter &operator[](size_t col) {
+        return cols[col];
+    }
+
+    inline void end_row() {
+        n_rows++;
+    }
+
+    bool empty() const {
+        return n_rows == 0;
+    }
+
+    // Appends the encoded block to `out`, then starts a new block.
+    void flush_to(std::vector<uint8_t> &out) {
+        if (empty())
+            return;
+        BlockHeader header{MAGIC, VERSION, kind, n_rows, (uint32_t) cols.size()};
+        append(out, &header, sizeof(header));
+        for (const auto &col: cols) {
+            uint64_t len = col.bytes().size();
+            append(out, &len, sizeof(len));
+        }
+        for (auto &col: cols) {
+            append(out, col.bytes().data(), col.bytes().size());
+            col.clear();
+        }
+        n_rows = 0;
+    }
+
+    void flush_to(FILE *file) {
+        if (empty())
+            return;
+        std::vector<uint8_t> out;
+        flush_to(out);
+        fwrite(out.data(), 1, out.size(), file);
+    }
+
+private:
+    static void append(std::vector<uint8_t> &out, const void *data, size_t len) {
+        auto *bytes = (const uint8_t *) data;
+        out.insert(out.end(), bytes, bytes + len);
+    }
+
+    std::vector<ColumnWriter> cols;
+    uint32_t n_rows;
+    Kind kind;
+};
+
+class ColumnReader {
+public:
+    ColumnReader() : p(nullptr), end(nullptr), prev(0) {}
+
+    ColumnReader(const uint8_t *_p, const uint8_t *_end) : p(_p), end(_end), prev(0) {}
+
+    // Returns 0 past the end of the column (or for a missing column).
+    inline uint64_t get() {
+        uint64_t v = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) {
+            uint8_t byte = *p++;
+            v |= (uint64_t) (byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        return v;
+    }
+
+    // True for a column missing from the block.
+    bool empty() const {
+        return p == nullptr;
+    }
+
+    inline int64_t get_signed() {
+        return unzigzag(get());
+    }
+
+    inline uint64_t get_delta() {
+        prev += (uint64_t) get_signed();
+        return prev;
+    }
+
+private:
+    const uint8_t *p, *end;
+    uint64_t prev;
+};
+
+// Iterates over the blocks of a memory-mapped file.
+class BlockReader {
+public:
+    BlockReader(const void *data, size_t len) :
+            p((const uint8_t *) data), end((const uint8_t *) data + len) {}
+
+    // True for a block sequence or a container of them.
+    static bool is_binary(const void *data, size_t len) {
+        uint32_t magic;
+        if (len < sizeof(magic))
+            return false;
+        memcpy(&magic, data, sizeof(magic));
+        return magic == MAGIC || magic == CONTAINER_MAGIC;
+    }
+
+    // Positions `cols` on the next block, resized to at least `n_cols`.
+    // Returns false at the end of the data, or if the block is malformed.
+    bool next(BlockHeader &header, std::vector<ColumnReader> &cols, size_t n_cols) {
+        if ((size_t) (end - p) < sizeof(header))
+            return false;
+        memcpy(&header, p, sizeof(header));
+        if (header.magic != MAGIC || header.version > VERSION)
+            return false;
+        const uint8_t *lens = p + sizeof(header);
+        if ((size_t) (end - lens) / sizeof(uint64_t) < header.n_cols)
+            return false;
+        const uint8_t *col = lens + header.n_cols * sizeof(uint64_t);
+        cols.assign(std::max<size_t>(n_cols, header.n_cols), ColumnReader());
+        for (uint32_t i = 0; i < header.n_cols; i++) {
+            uint64_t len;
+            memcpy(&len, lens + i * sizeof(uint64_t), sizeof(len));
+            if ((uint64_t) (end - col) < len)
+                return false;
+            cols[i] = ColumnReader(col, col + len);
+            col += len;
+        }
+        p = col;
+        return true;
+    }
+
+private:
+    const uint8_t *p, *end;
+};
+
+// Splits a file into the segments to decode: those listed in a container, or
+// the whole file if it is a plain sequence of blocks. Returns false if the
+// container index is malformed.
+inline bool read_segments(const void *data, size_t len, std::vector<SegmentEntry> &segments) {
+    segments.clear();
+    ContainerHeader header{};
+    if (len < sizeof(header)) {
+        segments.push_back(SegmentEntry{0, 0, len});
+        return true;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != CONTAINER_MAGIC) {
+        segments.push_back(SegmentEntry{0, 0, len});
+        return true;
+    }
+    if (header.version > VERSION || (len - sizeof(header)) / sizeof(SegmentEntry) < header.n_segments)
+        return false;
+    segments.resize(header.n_segments);
+    memcpy(segments.data(), (const uint8_t *) data + sizeof(header), header.n_segments * sizeof(SegmentEntry));
+    for (const auto &seg: segments)
+        if (seg.offset > len || len - seg.offset < seg.length)
+            return false;
+    return true;
+}
+
+}
+
+#endif //RUNTIME_LOGFORMAT_H
@@ -0,0 +1,298 @@
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "LogWriter.h"
+
+// In LibFuncs.h: the writer thread must not go through our pthread_create.
+int __internal_pthread_create(pthread_t *t1, const pthread_attr_t *t2,
+                              void *(*t3)(void *), void *t4);
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// IORING_OP_WRITE came with the same kernel headers (5.6) as this flag.
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+// Minimal io_uring built on the raw system calls: one submitter, one waiter,
+// both being the writer thread.
+class IoUring {
+public:
+    static const unsigned ENTRIES = 64;
+
+    ~IoUring() {
+        if (ring_fd >= 0)
+            release();
+    }
+
+    bool init() {
+        io_uring_params params{};
+        ring_fd = (int) syscall(__NR_io_uring_setup, ENTRIES, &params);
+        if (ring_fd < 0)
+            return false;
+        size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sq_len = cq_len = std::max(sq_len, cq_len);
+        sq = map(sq_len, IORING_OFF_SQ_RING);
+        cq = single ? sq : map(cq_len, IORING_OFF_CQ_RING);
+        sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *) map(sqes_len, IORING_OFF_SQES);
+        ring_len[0] = sq_len, ring_len[1] = single ? 0 : cq_len;
+        if (!sq || !cq || !sqes)
+            return release();
+        sq_tail = (unsigned *) (sq + params.sq_off.tail);
+        sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+        sq_array = (unsigned *) (sq + params.sq_off.array);
+        cq_head = (unsigned *) (cq + params.cq_off.head);
+        cq_tail = (unsigned *) (cq + params.cq_off.tail);
+        cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Writes n <= ENTRIES buffers; res[i] gets the result of the i-th write
+    // (bytes written, or -errno).
+    bool write(unsigned n, const int *fds, void *const *bufs, const size_t *lens,
+               const off_t *offs, int64_t *res) {
+        unsigned tail = *sq_tail;
+        for (unsigned i = 0; i < n; i++, tail++) {
+            unsigned idx = tail & sq_mask;
+            io_uring_sqe &sqe = sqes[idx];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_WRITE;
+            sqe.fd = fds[i];
+            sqe.addr = (uint64_t) bufs[i];
+            sqe.len = (uint32_t) lens[i];
+            sqe.off = (uint64_t) offs[i];
+            sqe.user_data = i;
+            sq_array[idx] = idx;
+        }
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        unsigned done = 0;
+        while (done < n) {
+            long ret = syscall(__NR_io_uring_enter, ring_fd, done ? 0 : n, n - done,
+                               IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0 && errno != EINTR)
+                return false;
+            unsigned head = *cq_head;
+            unsigned ctail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != ctail; head++, done++) {
+                const io_uring_cqe &cqe = cqes[head & cq_mask];
+                res[cqe.user_data] = cqe.res;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+        return true;
+    }
+
+private:
+    char *map(size_t len, off_t what) {
+        void *mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, what);
+        return mem == MAP_FAILED ? nullptr : (char *) mem;
+    }
+
+    bool release() {
+        if (sqes)
+            munmap(sqes, sqes_len);
+        if (cq && cq != sq)
+            munmap(cq, ring_len[1]);
+        if (sq)
+            munmap(sq, ring_len[0]);
+        close(ring_fd);
+        ring_fd = -1;
+        return false;
+    }
+
+    int ring_fd = -1;
+    char *sq = nullptr, *cq = nullptr;
+    size_t ring_len[2] = {0, 0}, sqes_len = 0;
+    io_uring_sqe *sqes = nullptr;
+    unsigned *sq_tail = nullptr, *sq_array = nullptr, *cq_head = nullptr, *cq_tail = nullptr;
+    unsigned sq_mask = 0, cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+};
+#else
+class IoUring {};
+#endif
+
+namespace {
+
+// Writes all of buf[0, len) at off, retrying on short writes.
+bool pwrite_all(int fd, const uint8_t *buf, size_t len, off_t off) {
+    while (len) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n, len -= n, off += n;
+    }
+    return true;
+}
+
+}
+
+LogWriter &LogWriter::getInstance() {
+    static char buf[sizeof(LogWriter)];
+    static auto *theOneTrueObject = new(buf) LogWriter();
+    return *theOneTrueObject;
+}
+
+LogWriter::LogWriter() : thread(), running(false), stopping(false), bytes_written(0), blocked_ns(0) {}
+
+void LogWriter::start() {
+    std::lock_guard<std::mutex> lg(lock);
+    if (running)
+        return;
+    stopping = false;
+    running = __internal_pthread_create(&thread, nullptr, run, this) == 0;
+    if (!running)
+        fprintf(stderr, "Cannot start log writer, writing synchronously!!\n");
+}
+
+void LogWriter::stop() {
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        if (!running)
+            return;
+        stopping = true;
+    }
+    queued.notify_one();
+    pthread_join(thread, nullptr);
+    running = false;
+}
+
+void LogWriter::enqueue(DoubleBuffer *owner, int which) {
+    owner->in_flight[which].store(true, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        if (running) {
+            queue.push_back(Request{owner, which});
+            queued.notify_one();
+            return;
+        }
+    }
+    // No writer thread (not started, or already stopped).
+    std::vector<Request> batch{Request{owner, which}};
+    IoUring *no_ring = nullptr;
+    write_batch(batch, no_ring);
+}
+
+void LogWriter::wait_for(DoubleBuffer *owner, int which) {
+    if (!owner->in_flight[which].load(std::memory_order_acquire))
+        return;
+    auto begin = std::chrono::steady_clock::now();
+    {
+        std::unique_lock<std::mutex> ul(lock);
+        written.wait(ul, [owner, which] {
+            return !owner->in_flight[which].load(std::memory_order_acquire);
+        });
+    }
+    auto blocked = std::chrono::steady_clock::now() - begin;
+    blocked_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(blocked).count();
+}
+
+void *LogWriter::run(void *arg) {
+    auto *writer = (LogWriter *) arg;
+    IoUring *ring = nullptr;
+#ifdef HAVE_IO_URING
+    IoUring ring_storage;
+    if (ring_storage.init())
+        ring = &ring_storage;
+#endif
+    std::vector<Request> batch;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> ul(writer->lock);
+            writer->queued.wait(ul, [writer] { return writer->stopping || !writer->queue.empty(); });
+            if (writer->queue.empty())
+                break;
+            batch.assign(writer->queue.begin(), writer->queue.end());
+            writer->queue.clear();
+        }
+        writer->write_batch(batch, ring);
+    }
+    return nullptr;
+}
+
+void LogWriter::write_batch(std::vector<Request> &batch, IoUring *&ring) {
+    size_t first = 0;
+#ifdef HAVE_IO_URING
+    while (ring && first < batch.size()) {
+        unsigned n = (unsigned) std::min<size_t>(IoUring::ENTRIES, batch.size() - first);
+        int fds[IoUring::ENTRIES];
+        void *bufs[IoUring::ENTRIES];
+        size_t lens[IoUring::ENTRIES];
+        off_t offs[IoUring::ENTRIES];
+        int64_t res[IoUring::ENTRIES];
+        for (unsigned i = 0; i < n; i++) {
+            const Request &req = batch[first + i];
+            fds[i] = req.owner->fd;
+            bufs[i] = req.owner->bufs[req.which].data();
+            lens[i] = req.owner->bufs[req.which].size();
+            offs[i] = req.owner->offsets[req.which];
+            res[i] = 0;
+        }
+        if (!ring->write(n, fds, bufs, lens, offs, res)) {
+            // Write the rest of the batch, and everything after, with pwrite.
+            ring = nullptr;
+            break;
+        }
+        // Finish short or failed writes (e.g. an old kernel without IORING_OP_WRITE) with pwrite.
+        for (unsigned i = 0; i < n; i++) {
+            size_t done = res[i] > 0 ? (size_t) res[i] : 0;
+            if (done < lens[i] &&
+                !pwrite_all(fds[i], (const uint8_t *) bufs[i] + done, lens[i] - done, offs[i] + done))
+                fprintf(stderr, "Cannot write log: %s\n", strerror(errno));
+            bytes_written += lens[i];
+        }
+        first += n;
+    }
+#endif
+    for (size_t i = first; i < batch.size(); i++) {
+        const Request &req = batch[i];
+        const std::vector<uint8_t> &buf = req.owner->bufs[req.which];
+        if (!pwrite_all(req.owner->fd, buf.data(), buf.size(), req.owner->offsets[req.which]))
+            fprintf(stderr, "Cannot write log: %s\n", strerror(errno));
+        bytes_written += buf.size();
+    }
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        for (const auto &req: batch) {
+            req.owner->bufs[req.which].clear();
+            req.owner->in_flight[req.which].store(false, std::memory_order_release);
+        }
+    }
+    written.notify_all();
+}
+
+DoubleBuffer::DoubleBuffer(int _fd) : offsets{0, 0}, in_flight{{false}, {false}}, fd(_fd), cur(0), end(0) {}
+
+void DoubleBuffer::submit() {
+    LogWriter &writer = LogWriter::getInstance();
+    if (bufs[cur].empty())
+        return;
+    offsets[cur] = end;
+    end += bufs[cur].size();
+    writer.enqueue(this, cur);
+    cur ^= 1;
+    writer.wait_for(this, cur);
+}
+
+void DoubleBuffer::sync() {
+    submit();
+    LogWriter &writer = LogWriter::getInstance();
+    writer.wait_for(this, 0);
+    writer.wait_for(this, 1);
+}
@@ -0,0 +1,103 @@
+#ifndef RUNTIME_LOGWRITER_H
+#define RUNTIME_LOGWRITER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+
+class DoubleBuffer;
+
+class IoUring;
+
+// Background thread writing encoded log blocks to disk, so that application
+// threads only ever encode into memory. Batches of writes go through io_uring
+// when the kernel supports it, and through pwrite otherwise.
+class LogWriter {
+public:
+    static LogWriter &getInstance();
+
+    // Starts the writer thread. Call before any thread logs.
+    void start();
+
+    // Drains everything that is queued and joins the writer thread.
+    void stop();
+
+    uint64_t get_bytes_written() const {
+        return bytes_written.load();
+    }
+
+    uint64_t get_blocked_ns() const {
+        return blocked_ns.load();
+    }
+
+private:
+    friend class DoubleBuffer;
+
+    struct Request {
+        DoubleBuffer *owner;
+        int which;
+    };
+
+    LogWriter();
+
+    void enqueue(DoubleBuffer *owner, int which);
+
+    // Blocks the caller until `owner`'s buffer `which` has been written.
+    void wait_for(DoubleBuffer *owner, int which);
+
+    static void *run(void *arg);
+
+    // `ring` is reset to null if io_uring turns out not to work.
+    void write_batch(std::vector<Request> &batch, IoUring *&ring);
+
+    std::mutex lock;
+    std::condition_variable queued, written;
+    std::deque<Request> queue;
+    pthread_t thread;
+    bool running, stopping;
+    std::atomic<uint64_t> bytes_written, blocked_ns;
+};
+
+// Log file of one thread. The owning thread encodes into the active buffer
+// while the writer drains the other one.
+class DoubleBuffer {
+public:
+    explicit DoubleBuffer(int _fd);
+
+    std::vector<uint8_t> &active() {
+        return bufs[cur];
+    }
+
+    // Hands the active buffer to the writer and switches to the other one,
+    // waiting if that one is still being written.
+    void submit();
+
+    // Submits what is left and waits until all of it is in the file.
+    void sync();
+
+    int get_fd() const {
+        return fd;
+    }
+
+    // Bytes submitted so far, i.e. the file size once they are written.
+    off_t get_end() const {
+        return end;
+    }
+
+private:
+    friend class LogWriter;
+
+    std::vector<uint8_t> bufs[2];
+    off_t offsets[2];
+    std::atomic<bool> in_flight[2];
+    int fd, cur;
+    // Where the next submitted buffer goes in the file.
+    off_t end;
+};
+
+#endif //RUNTIME_LOGWRITER_H
@@ -1,54 +1,121 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
 #include "LoggingThread.h"
+#include "HeavyHitters.h"
 
 void Thread::flush_log() {
-    for (const auto &rw_n: this->outputBuf)
-        // if (rw_n.second.second)  // if is not read-only
-        rw_n.first.dump(this->buffer_f, this->index, rw_n.second.first, rw_n.second.second);
-    this->outputBuf.clear();
+    if (this->hitters)
+        this->hitters->drain([this](const LogEntry &e) {
+            this->pending.push_back(e);
+        });
+    else
+        this->outputBuf->drain([this](const LocTable::Entry &e) {
+            this->pending.push_back(LogEntry{e.rec, e.r, e.w, 0, e.first, e.last});
+        });
+    this->write_pending();
+}
+
+void Thread::hand_off(uint64_t gen) {
+    this->flush_log();
+    if (this->log_out) {
+        this->log_out->sync();
+        this->snapshot_end = (uint64_t) this->log_out->get_end();
+    }
+    this->snapshot_seen.store(gen, std::memory_order_release);
+}
+
+void Thread::spill_log() {
+    this->outputBuf->spill([this](const LocTable::Entry &e) {
+        this->pending.push_back(LogEntry{e.rec, e.r, e.w, 0, e.first, e.last});
+    });
+    this->write_pending();
+}
+
+void Thread::write_pending() {
+    // Sorted addresses make the delta-coded address column small.
+    std::sort(this->pending.begin(), this->pending.end(),
+              [](const LogEntry &lhs, const LogEntry &rhs) {
+                  return lhs.rec.addr < rhs.rec.addr;
+              });
+    const BurstSampler &sampler = BurstSampler::getInstance();
+    for (const auto &e: this->pending)
+        e.rec.append_to(this->log_block, this->index, sampler.scale(e.r), sampler.scale(e.w),
+                        sampler.scale(e.err), e.first, e.last);
+    this->pending.clear();
+    if (!this->log_out)
+        return;
+    this->log_block.flush_to(this->log_out->active());
+    if (this->log_out->active().size() >= LOG_SUBMIT_SIZE)
+        this->log_out->submit();
 }
 
 void Thread::log_load_store(const LocRecord &rw, bool is_write) {
-    if (!writing)
+    if (!writing->load(std::memory_order_relaxed))
+        return;
+    uint64_t now = coarse_time();
+    if (this->hitters) {
+        this->hitters->add(rw, is_write, now);
         return;
-    if (this->outputBuf.size() == LOG_SIZE)
-        this->flush_log();
-    auto it = this->outputBuf.find(rw);
-    if (it != this->outputBuf.end()) {
-        if (is_write)
-            it->second.second++;
-        else
-            it->second.first++;
-    } else {
-        auto pair = is_write ? std::make_pair(0, 1) : std::make_pair(1, 0);
-        this->outputBuf.emplace(rw, pair);
     }
+    if (this->outputBuf->full())
+        this->spill_log();
+    this->outputBuf->add(rw, is_write, now);
 }
 
 std::string Thread::get_filename() {
-    return "__record__" + std::to_string(this->index) + ".log";
+    return "__record__" + std::to_string(this->slot) + ".log";
 }
 
 void Thread::stop_logging() {
     *writing = false;
     flush_log();
-    if (this->buffer_f)
-        fclose(this->buffer_f);
+    if (this->log_out) {
+        this->log_out->sync();
+        close(this->log_out->get_fd());
+    }
 }
 
 void Thread::open_buffer() {
     auto filename = get_filename();
-    this->buffer_f = fopen(filename.c_str(), "a");
-    if (!this->buffer_f) {
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
         fprintf(stderr, "Cannot open file!!\n");
         return;
     }
+    this->log_out = new DoubleBuffer(fd);
     *writing = true;
 }
 
-Thread::Thread(int _index, threadFunction _startRoutine, void *_startArg) :
-        buffer_f(nullptr), startRoutine(_startRoutine), startArg(_startArg),
-        index(_index), all_hooks_active(false) {
-    writing = new std::atomic<bool>;
-    this->outputBuf.reserve(LOG_SIZE);
+Thread::Thread(int _slot, int _index, threadFunction _startRoutine, void *_startArg) :
+        outputBuf(nullptr), hitters(nullptr), log_block(logfmt::RECORDS, logfmt::R_NCOLS), log_out(nullptr),
+        startRoutine(_startRoutine), startArg(_startArg),
+        index(_index), slot(_slot), ownership{0, 0}, allocated(0), snapshot_seen(0), snapshot_end(0) {
+    writing = new std::atomic<bool>(false);
+    if (size_t budget = HeavyHitters::budget_from_env())
+        this->hitters = new HeavyHitters(budget);
+    else
+        this->outputBuf = new LocTable(LOG_SIZE);
     this->open_buffer();
 }
+
+void Thread::reuse(int _index, threadFunction _startRoutine, void *_startArg) {
+    this->index = _index;
+    this->startRoutine = _startRoutine;
+    this->startArg = _startArg;
+}
+
+void Thread::finish() {
+    // Records carry the thread id, so the next thread in this slot can go on
+    // with the same log file.
+    this->flush_log();
+    this->collect_hot();
+}
+
+void Thread::collect_hot() {
+    this->ownership.transfers += hot_state.ownership.transfers;
+    this->ownership.bouncing += hot_state.ownership.bouncing;
+    this->allocated += hot_state.allocated;
+    hot_state.ownership = OwnershipStats{0, 0};
+    hot_state.allocated = 0;
+}
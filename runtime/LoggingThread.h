@@ -2,79 +2,281 @@
 #define LOGGINGTHREAD_H
 
 #include <pthread.h>
-#include <unordered_map>
 #include <atomic>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <x86intrin.h>
+#include "LogFormat.h"
+#include "LogWriter.h"
+#include "Ownership.h"
+#include "Sampling.h"
 
 typedef void *threadFunction(void *);
 
 const size_t LOG_SIZE = 1 << 16;
 
+// Encoded log bytes a thread accumulates before handing them to the writer.
+const size_t LOG_SUBMIT_SIZE = 1 << 20;
+
+// Records keep when they were first and last accessed, in TSC ticks of
+// 2^16 cycles: coarse, but enough to tell whether threads used a line at
+// the same time.
+const int TIME_SHIFT = 16;
+
+inline uint64_t coarse_time() {
+    return __rdtsc() >> TIME_SHIFT;
+}
+
 struct LocRecord {
     uintptr_t addr;
     uint32_t func_id, inst_id;
     uint16_t size;
     bool is_heap;
     uint32_t m_id, m_offset;
+    // Barrier phase of the accesses (see Phases.h).
+    uint32_t phase;
 
     LocRecord(uintptr_t _addr, uint32_t _func_id, uint32_t _inst_id, uint16_t _size,
-              uint32_t m_id, uint32_t m_size) :
+              uint32_t m_id, uint32_t m_size, uint32_t _phase) :
             addr(_addr), func_id(_func_id), inst_id(_inst_id), size(_size),
-            is_heap(true), m_id(m_id), m_offset(m_size) {}
-
-    LocRecord(uintptr_t _addr, uint32_t _func_id, uint32_t _inst_id, uint16_t _size) :
-            addr(_addr), func_id(_func_id), inst_id(_inst_id), size(_size),
-            is_heap(false), m_id(), m_offset() {}
+            is_heap(true), m_id(m_id), m_offset(m_size), phase(_phase) {}
 
     LocRecord() = default;
 
-    void dump(FILE *fd, int thread_fd, unsigned int r, unsigned int w) const {
-        if (is_heap)
-            fprintf(fd, "%d,%p,%u,%u,%u,%u,%u,%u,%u\n",
-                thread_fd, (void *) addr, m_id, m_offset, func_id, inst_id, size, r, w);
-        else
-            fprintf(fd, "%d,%p,-1,-1,%u,%u,%u,%u,%u\n",
-                    thread_fd, (void *) addr, func_id, inst_id, size, r, w);
+    // An access to the globals: `var` is 0 outside every variable and k + 1
+    // in global variable k (see GetGlobal.h).
+    static LocRecord global(uintptr_t _addr, uint32_t _func_id, uint32_t _inst_id, uint16_t _size,
+                            uint32_t var, uint32_t var_offset, uint32_t _phase) {
+        LocRecord rec(_addr, _func_id, _inst_id, _size, var, var_offset, _phase);
+        rec.is_heap = false;
+        return rec;
+    }
+
+    void append_to(logfmt::BlockWriter &block, int thread, uint64_t r, uint64_t w, uint64_t err,
+                   uint64_t first, uint64_t last) const {
+        using namespace logfmt;
+        block[R_THREAD].put((uint64_t) thread);
+        block[R_ADDR].put_delta(addr);
+        block[R_M_ID].put_signed(is_heap ? (int64_t) m_id : -1 - (int64_t) m_id);
+        block[R_M_OFFSET].put(m_offset);
+        block[R_FUNC].put(func_id);
+        block[R_INST].put(inst_id);
+        block[R_SIZE].put(size);
+        block[R_READS].put(r);
+        block[R_WRITES].put(w);
+        block[R_ERROR].put(err);
+        block[R_PHASE].put(phase);
+        block[R_FIRST].put_delta(first);
+        block[R_SPAN].put(last - first);
+        block.end_row();
     }
 
-    bool operator==(const LocRecord &rhs) const {
-        return (
-                addr == rhs.addr &&
-                func_id == rhs.func_id &&
-                inst_id == rhs.inst_id
-        );
+    // func_id and inst_id packed into one word, used as part of the aggregation key.
+    inline uint64_t pc() const {
+        return ((uint64_t) func_id << 32) | inst_id;
+    }
+
+    // The same address is a different record once its block is freed and reallocated.
+    inline bool same_key(const LocRecord &rhs) const {
+        return addr == rhs.addr && pc() == rhs.pc() && m_id == rhs.m_id && phase == rhs.phase;
+    }
+
+    inline uint64_t hash() const {
+        uint64_t h = (addr ^ ((pc() + m_id + ((uint64_t) phase << 48)) * 0xff51afd7ed558ccdUL));
+        return h * 0x9e3779b97f4a7c15UL;
     }
 };
 
-namespace std {
-    template<>
-    struct hash<LocRecord> {
-        template<class T>
-        inline void hash_combine(std::size_t &seed, const T &v) const {
-            // From boost library.
-            std::hash<T> hasher;
-            seed ^= hasher(v) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+// A record on its way to the log.
+struct LogEntry {
+    LocRecord rec;
+    uint64_t r, w;
+    // Accesses the counts may be missing; only heavy-hitter mode leaves any.
+    uint64_t err;
+    // coarse_time of the first and last access.
+    uint64_t first, last;
+};
+
+// Bounded, open-addressing (linear probing) table aggregating read/write
+// counts per (address, PC, allocation, phase). It starts small and doubles up
+// to its bound, so that threads which log little cost little; counters are
+// incremented in place.
+// An entry with both counters zero is an empty slot; they are 64 bits wide
+// so that a hot entry, which is never spilled, cannot wrap around to it.
+class LocTable {
+public:
+    struct Entry {
+        LocRecord rec;
+        uint64_t r, w;
+        uint64_t first, last;
+    };
+
+    static const size_t MIN_CAP = 1 << 10;
+
+    // Keep the load factor at most 1/2 so that probe sequences stay short.
+    explicit LocTable(size_t max_entries) : used(0), max_used(max_entries), max_cap(1) {
+        while (max_cap < 2 * max_entries)
+            max_cap <<= 1;
+        size_t cap = max_cap < MIN_CAP ? max_cap : MIN_CAP;
+        mask = cap - 1;
+        slots = new Entry[cap]();
+    }
+
+    ~LocTable() {
+        delete[] slots;
+    }
+
+    LocTable(LocTable &&rhs) noexcept : slots(rhs.slots), mask(rhs.mask), used(rhs.used),
+                                        max_used(rhs.max_used), max_cap(rhs.max_cap) {
+        rhs.slots = nullptr;
+    }
+
+    LocTable(const LocTable &) = delete;
+
+    LocTable &operator=(const LocTable &) = delete;
+
+    inline bool full() const {
+        return used >= max_used;
+    }
+
+    // Caller makes sure the table is not full.
+    inline void add(const LocRecord &rec, bool is_write, uint64_t now) {
+        if (2 * (used + 1) > mask + 1 && mask + 1 < max_cap)
+            grow();
+        size_t i = home(rec);
+        while (true) {
+            Entry &e = slots[i];
+            if (!e.r && !e.w) {
+                e.rec = rec;
+                e.first = now;
+                used++;
+                break;
+            }
+            if (e.rec.same_key(rec))
+                break;
+            i = (i + 1) & mask;
         }
+        if (is_write)
+            slots[i].w++;
+        else
+            slots[i].r++;
+        slots[i].last = now;
+    }
 
-        std::size_t operator()(const LocRecord &k) const {
-            using std::hash;
-            size_t seed = 0;
-            hash_combine(seed, k.addr);
-            hash_combine(seed, k.func_id);
-            hash_combine(seed, k.inst_id);
-            hash_combine(seed, k.size);
-            hash_combine(seed, k.is_heap);
-            hash_combine(seed, k.m_id);
-            hash_combine(seed, k.m_offset);
-            return seed;
+    // Emit and remove the coldest entries, at least half of them. The hot ones keep
+    // aggregating, so the log gets partial counts instead of a full flush per LOG_SIZE.
+    template<typename EmitT>
+    void spill(EmitT emit) {
+        // Histogram of floor(log2(r + w)); the cut-off is the smallest bucket that
+        // covers half of the entries.
+        size_t hist[65] = {};
+        for (size_t i = 0; i <= mask; i++)
+            if (slots[i].r || slots[i].w)
+                hist[log2_count(slots[i])]++;
+        size_t cutoff = 0, covered = hist[0];
+        while (covered * 2 < used)
+            covered += hist[++cutoff];
+        for (size_t i = 0; i <= mask; i++) {
+            // A removal may shift another entry into slot i, so look at it again.
+            while ((slots[i].r || slots[i].w) && log2_count(slots[i]) <= cutoff) {
+                emit(slots[i]);
+                remove_at(i);
+            }
         }
-    };
-}
+    }
+
+    // Emit and remove everything.
+    template<typename EmitT>
+    void drain(EmitT emit) {
+        for (size_t i = 0; i <= mask; i++) {
+            Entry &e = slots[i];
+            if (e.r || e.w) {
+                emit(e);
+                e.r = e.w = 0;
+            }
+        }
+        used = 0;
+    }
+
+private:
+    inline size_t home(const LocRecord &rec) const {
+        return (size_t) (rec.hash() >> 32) & mask;
+    }
+
+    // Rehashes into twice the slots.
+    void grow() {
+        Entry *old = slots;
+        size_t old_cap = mask + 1;
+        mask = 2 * old_cap - 1;
+        slots = new Entry[mask + 1]();
+        for (size_t j = 0; j < old_cap; j++) {
+            if (!old[j].r && !old[j].w)
+                continue;
+            size_t i = home(old[j].rec);
+            while (slots[i].r || slots[i].w)
+                i = (i + 1) & mask;
+            slots[i] = old[j];
+        }
+        delete[] old;
+    }
+
+    static size_t log2_count(const Entry &e) {
+        uint64_t n = e.r + e.w;
+        return 63 - __builtin_clzl(n);
+    }
+
+    // Backward-shift deletion, so that no probe sequence is left with a hole.
+    void remove_at(size_t i) {
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (!slots[j].r && !slots[j].w)
+                break;
+            size_t k = home(slots[j].rec);
+            // Entry j can move to i only if its home is not cyclically in (i, j].
+            bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+            if (stays)
+                continue;
+            slots[i] = slots[j];
+            i = j;
+        }
+        slots[i].r = slots[i].w = 0;
+        used--;
+    }
+
+    Entry *slots;
+    size_t mask, used, max_used, max_cap;
+};
 
-struct Thread {
-    // Buffer for read/write records.
-    std::unordered_map<LocRecord, std::pair<unsigned int, unsigned int>> outputBuf;
-    // File handle
-    FILE *buffer_f;
+class HeavyHitters;
+
+// What a thread writes on (nearly) every access or allocation. It lives in the
+// thread's own TLS, on cache lines of its own, rather than in its Thread,
+// which sits next to other threads' objects in the registry.
+struct alignas(64) HotState {
+    // True: malloc & pthread_create are our version.
+    bool all_hooks_active;
+    BurstState burst;
+    OwnershipStats ownership;
+    // Bytes allocated through our hooks.
+    uint64_t allocated;
+    // The thread's own stack and static TLS block, if they are tracked.
+    uintptr_t stack_lo, stack_hi, tls_lo, tls_hi;
+};
+
+// Thread objects are written by their own thread only; keep neighbours apart.
+struct alignas(64) Thread {
+    // Buffer for read/write records; null in heavy-hitter mode, where it
+    // would take many times the budget.
+    LocTable *outputBuf;
+    // Replaces outputBuf in heavy-hitter mode.
+    HeavyHitters *hitters;
+    // Records leaving outputBuf, sorted by address before being encoded.
+    std::vector<LogEntry> pending;
+    logfmt::BlockWriter log_block;
+    // Per-thread log file, written in the background.
+    DoubleBuffer *log_out;
     // Results of pthread_self
     // pthread_t self;
     // The following is the parameter about starting function.
@@ -82,15 +284,38 @@ struct Thread {
     void *startArg;
     // True: thread is writing to its buffer.
     std::atomic<bool> *writing;
-    // index of this thread object.
+    // Id of the thread, unique over the whole run.
     int index;
-    // True: malloc & pthread_create are our version.
-    bool all_hooks_active;
+    // Slot of this thread object in the registry, reused after the thread exits.
+    int slot;
+    // Line transfers seen by, and bytes allocated by, the threads that have
+    // left this slot (see collect_hot).
+    OwnershipStats ownership;
+    uint64_t allocated;
+    // Last snapshot this slot handed its log to, and the log size at that point.
+    std::atomic<uint64_t> snapshot_seen;
+    uint64_t snapshot_end;
+
+    Thread(int _slot, int _index, threadFunction _startRoutine, void *_startArg);
 
-    Thread(int _index, threadFunction _startRoutine, void *_startArg);
+    // Hands the slot, including its log, to a new thread.
+    void reuse(int _index, threadFunction _startRoutine, void *_startArg);
+
+    // Thread has exited: writes out what it has recorded.
+    void finish();
+
+    // Adds the calling thread's counters in hot_state to this slot's.
+    void collect_hot();
 
     void flush_log();
 
+    // Puts everything logged so far in the file for snapshot `gen`.
+    void hand_off(uint64_t gen);
+
+    void spill_log();
+
+    void write_pending();
+
     void log_load_store(const LocRecord &rw, bool is_write);
 
     std::string get_filename();
@@ -102,12 +327,21 @@ struct Thread {
 
 extern __thread Thread *current;
 
+extern __thread HotState hot_state;
+
+// `current` is null in threads we did not create, and in ours once they exit.
 class HookDeactivator {
     Thread *current_copy;
 public:
-    HookDeactivator() noexcept: current_copy(current) { current_copy->all_hooks_active = false; }
+    HookDeactivator() noexcept: current_copy(current) {
+        if (current_copy)
+            hot_state.all_hooks_active = false;
+    }
 
-    ~HookDeactivator() noexcept { current_copy->all_hooks_active = true; }
+    ~HookDeactivator() noexcept {
+        if (current_copy)
+            hot_state.all_hooks_active = true;
+    }
 
     Thread *get_current() {
         return current_copy;
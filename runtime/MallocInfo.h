@@ -7,144 +7,337 @@
 
 #include <cstdio>
 #include <map>
+#include <tuple>
 #include <sstream>
 #include <utility>
 #include <vector>
-#include <shared_mutex>
-#include <execinfo.h>
+#include <mutex>
+#include <cstdlib>
+#include <pthread.h>
+#include <link.h>
+#include <unordered_map>
 #include <cassert>
 #include <algorithm>
 #include "Segment.h"
+#include "GetGlobal.h"
 #include "LoggingThread.h"
 #include "SymbolCache.h"
-#include "SharedSpinLock.h"
-
-namespace std {
-    template<class T>
-    struct hash<std::vector<T>> {
-        std::size_t operator()(std::vector<T> const &vec) const {
-            std::size_t seed = vec.size();
-            std::hash<T> hasher;
-            for (auto &i : vec) {
-                seed ^= hasher(i) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
-            }
-            return seed;
-        }
-    };
-}
+#include "PageMap.h"
+#include "RegionTable.h"
+#include "StableArray.h"
+#include "Sampling.h"
 
 extern AddrSeg global;
+extern "C" uintptr_t __huron_heap_begin, __huron_heap_end;
 
 class MallocInfo {
-    struct PerAddr {
-        size_t id, size;
-
-        explicit PerAddr(size_t _id = 0, size_t _size = 0)
-                : id(_id), size(_size) {}
-    };
-
     struct PerBt {
         uintptr_t addr;
         size_t id, size, func, inst;
+        int thread;
 
-        explicit PerBt(uintptr_t _addr, size_t _id, size_t _size, size_t func, size_t inst)
-                : addr(_addr), id(_id), size(_size), func(func), inst(inst) {}
+        explicit PerBt(uintptr_t _addr, size_t _id, size_t _size, size_t func, size_t inst, int thread)
+                : addr(_addr), id(_id), size(_size), func(func), inst(inst), thread(thread) {}
 
         bool operator < (const PerBt &rhs) const {
             return addr < rhs.addr;
         }
     };
 
-    // This is an (ordered) map because we need to query lower bound for incoming access addresses.
-    std::map<uintptr_t, PerAddr> data_alive;
-    std::unordered_map<std::vector<void *>, std::vector<PerBt>> data_total;
-    // std::shared_timed_mutex mutex;
-    SharedSpinLock lock;
-    AddrSeg heap;
-    size_t id;
+    // Where allocations come from: the call site the Instrumenter numbered,
+    // plus a hash of the frames above it when stacks are enabled.
+    struct Site {
+        uint64_t func, inst, stack;
+
+        bool operator==(const Site &rhs) const {
+            return func == rhs.func && inst == rhs.inst && stack == rhs.stack;
+        }
+
+        bool operator<(const Site &rhs) const {
+            return std::tie(func, inst, stack) < std::tie(rhs.func, rhs.inst, rhs.stack);
+        }
+    };
+
+    struct SiteHash {
+        size_t operator()(const Site &site) const {
+            return (size_t) ((site.func << 32 ^ site.inst) * 0x9e3779b97f4a7c15ULL ^ site.stack);
+        }
+    };
+
+    struct SiteAllocs {
+        // Return addresses of the first allocation seen, symbolized at exit.
+        std::vector<void *> frames;
+        std::vector<PerBt> allocs;
+    };
+
+    // Allocations made by the threads of one thread slot. Only the thread in
+    // the slot adds to it; `lock` lets a snapshot read it meanwhile. Aligned
+    // so that neighbouring slots' allocations do not contend.
+    struct alignas(64) Registry {
+        std::mutex lock;
+        std::unordered_map<Site, SiteAllocs, SiteHash> sites;
+        // Ids are handed to each registry in batches.
+        size_t next_id = 0, id_end = 0;
+    };
+
+    static const unsigned MAX_STACK_DEPTH = 64;
+
+    static const size_t ID_BATCH = 1 << 10;
+
+    // Heap blocks this large would take an entry in each of their pages.
+    static const size_t LARGE_BLOCK = 1 << 20;
+
+    // Looked up on every heap access, so readers never take a lock; writers
+    // do not either.
+    PageMap data_alive;
+    // Heap blocks of LARGE_BLOCK bytes or more, looked up where data_alive
+    // has nothing, so that objects annotated in them are told apart.
+    RegionTable large_blocks;
+    // Regions registered through huron_register_region and thread stacks,
+    // looked up only where no allocation or object is live, so that the
+    // objects annotated in them are told apart.
+    RegionTable regions;
+    StableArray<Registry> registries;
+    // Only taken to add registries, once per thread slot.
+    std::mutex lock;
+    std::atomic<size_t> id;
+    // Frames hashed into each allocation site, from HURON_STACK_DEPTH; 0 keys
+    // sites by the Instrumenter's ids only.
+    unsigned stack_depth;
+    // Code of the runtime itself, whose frames are left out of site stacks.
+    AddrSeg runtime_text;
 
 public:
-    MallocInfo() : data_total(), heap(~0LU, 0), id(0) {
+    MallocInfo() : id(0), stack_depth(0), runtime_text(0, 0) {
         HookDeactivator deactiv;
+        if (const char *depth = getenv("HURON_STACK_DEPTH"))
+            stack_depth = std::min((unsigned) strtoul(depth, nullptr, 10), MAX_STACK_DEPTH);
+        if (stack_depth)
+            dl_iterate_phdr(find_runtime_text, &runtime_text);
+    }
+
+    bool has_stacks() const {
+        return stack_depth != 0;
     }
 
-    void dump(const char *path) const {
+    void dump(const char *path) {
+        using namespace logfmt;
         FILE *file = fopen(path, "w");
-        fprintf(file, "-1,%lu,%lu,-1,-1\n", global.get_start(), global.get_size());
-        for (const auto &p: data_total) {
-            for (const auto &per_bt: p.second) {
-                fprintf(file, "%lu,%lu,%lu,%lu,%lu\n", 
-                        per_bt.id, per_bt.addr, per_bt.size, per_bt.func, per_bt.inst
-                );
+        if (!file) {
+            fprintf(stderr, "Cannot open file!!\n");
+            return;
+        }
+        BlockWriter block(MALLOCS, M_NCOLS);
+        block[M_ID].put_signed(-1);
+        block[M_START].put_delta(global.get_start());
+        block[M_SIZE].put(global.get_size());
+        block[M_FUNC].put_signed(-1);
+        block[M_INST].put_signed(-1);
+        block[M_THREAD].put_signed(-1);
+        block[M_STACK].put(0);
+        block.end_row();
+        GlobalSymbols::getInstance().dump_rows(block);
+        for (size_t i = 0; i < registries.size(); i++) {
+            std::lock_guard<std::mutex> lg(registries[i].lock);
+            for (const auto &p: registries[i].sites) {
+                for (const auto &per_bt: p.second.allocs) {
+                    block[M_ID].put_signed((int64_t) per_bt.id);
+                    block[M_START].put_delta(per_bt.addr);
+                    block[M_SIZE].put(per_bt.size);
+                    block[M_FUNC].put_signed((int64_t) per_bt.func);
+                    block[M_INST].put_signed((int64_t) per_bt.inst);
+                    block[M_THREAD].put_signed(per_bt.thread);
+                    block[M_STACK].put(p.first.stack);
+                    block.end_row();
+                }
             }
         }
+        block.flush_to(file);
+        BlockWriter meta(META, META_NCOLS);
+        meta[META_LINE_SAMPLE].put(LineSampler::getInstance().get_n());
+        meta.end_row();
+        meta.flush_to(file);
         fclose(file);
     }
 
-    void dump_with_bt(const char *path) const {
+    // Writes the symbolized frames of every allocation site, each once, as
+    // "func,inst,stack" followed by one line per frame and an empty line.
+    void dump_sites(const char *path) {
+        std::map<Site, const std::vector<void *> *> all_sites;
+        for (size_t i = 0; i < registries.size(); i++) {
+            std::lock_guard<std::mutex> lg(registries[i].lock);
+            for (const auto &p: registries[i].sites)
+                all_sites.emplace(p.first, &p.second.frames);
+        }
         FILE *file = fopen(path, "w");
-        assert(file);
+        if (!file) {
+            fprintf(stderr, "Cannot open file!!\n");
+            return;
+        }
         SymbolCache scache;
-        std::vector<PerBt> all_records;
-        for (const auto &p: data_total) {
-            for (const auto &per_bt: p.second)
-                fprintf(file, "%lu,%p,%lu\n", per_bt.id, (void *) per_bt.addr, per_bt.size);
-            scache.backtrace_symbols_fd(p.first, file);
-            all_records.insert(all_records.end(), p.second.begin(), p.second.end());
+        for (const auto &p: all_sites) {
+            fprintf(file, "%lu,%lu,%lu\n", p.first.func, p.first.inst, p.first.stack);
+            scache.backtrace_symbols_fd(*p.second, file);
+            fprintf(file, "\n");
+        }
+        fclose(file);
+    }
+
+    // Records an allocation of the calling thread, which must be one of ours,
+    // or with `region`, a large range holding allocations of its own.
+    void insert(uintptr_t start, size_t size, uint64_t func_id, uint64_t inst_id, bool region = false) {
+        // No access to it could ever be logged.
+        const LineSampler &lines = LineSampler::getInstance();
+        if (lines.enabled() && !lines.sampled_range(start, size))
+            return;
+        Registry &reg = registry_of(current->slot);
+        if (reg.next_id == reg.id_end) {
+            reg.next_id = id.fetch_add(ID_BATCH, std::memory_order_relaxed);
+            reg.id_end = reg.next_id + ID_BATCH;
         }
-        std::sort(all_records.begin(), all_records.end());
-        for (const auto &per_bt: all_records)
-            fprintf(file, "%lu,%p,%lu\n", per_bt.id, (void *) per_bt.addr, per_bt.size);
+        size_t m_id = reg.next_id++;
+        void *frames[MAX_STACK_DEPTH];
+        unsigned n_frames = walk_stack(frames);
+        Site site{func_id, inst_id, hash_frames(frames, n_frames)};
+        widen_heap(start, start + size);
+        EpochDomain &epochs = EpochDomain::getInstance();
+        epochs.enter(current->slot);
+        PageMap::AllocDesc desc{start, size, m_id, func_id << 32 | inst_id};
+        if (region)
+            regions.insert(current->slot, desc);
+        else if (size >= LARGE_BLOCK && func_id != (uint64_t) logfmt::FUNC_REGION)
+            large_blocks.insert(current->slot, desc);
+        else
+            data_alive.insert(current->slot, desc);
+        epochs.quiesce(current->slot);
+        std::lock_guard<std::mutex> lg(reg.lock);
+        SiteAllocs &allocs = reg.sites[site];
+        if (allocs.allocs.empty())
+            allocs.frames.assign(frames, frames + n_frames);
+        allocs.allocs.emplace_back(start, m_id, size, func_id, inst_id, current->index);
     }
 
-    void insert(uintptr_t start, size_t size, uint64_t func_id, uint64_t inst_id) {
-        // This function itself is single threaded,
-        // so not all operations need protection with lock.
-        static void *bt_buf[1000];
-        int bt_size = backtrace(bt_buf, 1000);
-        std::vector<void *> bt(bt_buf, bt_buf + bt_size);
-        lock.lock();
-        data_alive[start] = PerAddr(id, size);
-        lock.unlock();
-        heap.insert(AddrSeg(start, start + size));
-        data_total[bt].emplace_back(start, id, size, func_id, inst_id);
-        id++;
+    // Any thread may free what another one allocated.
+    bool erase(uintptr_t addr, bool region = false, PageMap::AllocDesc *erased = nullptr) {
+        EpochDomain &epochs = EpochDomain::getInstance();
+        epochs.enter(current->slot);
+        PageMap::AllocDesc desc{};
+        bool found = region ? regions.erase(current->slot, addr, desc) :
+                     data_alive.erase(current->slot, addr, desc) || large_blocks.erase(current->slot, addr, desc);
+        epochs.quiesce(current->slot);
+        if (found && erased)
+            *erased = desc;
+        return found;
     }
 
-    bool erase(uintptr_t addr) {
-        lock.lock();
-        auto it = data_alive.find(addr);
-        if (it == data_alive.end()) {
-            lock.unlock();
-            return false;
-        }
-        size_t size = it->second.size;
-        data_alive.erase(it);
-        lock.unlock();
-        heap.shrink(AddrSeg(addr, addr + size));
-        return true;
+    // Brings back a block `erase` removed, with its id, e.g. when the realloc
+    // that was to replace it fails.
+    void restore(const PageMap::AllocDesc &desc) {
+        EpochDomain &epochs = EpochDomain::getInstance();
+        epochs.enter(current->slot);
+        if (desc.size >= LARGE_BLOCK)
+            large_blocks.insert(current->slot, desc);
+        else
+            data_alive.insert(current->slot, desc);
+        epochs.quiesce(current->slot);
+    }
+
+    // The bounds read by the Instrumenter's inline filter only ever grow:
+    // shrinking them on free would need the writers to agree on the extent of
+    // the live allocations.
+    static void widen_heap(uintptr_t start, uintptr_t end) {
+        uintptr_t cur = __atomic_load_n(&__huron_heap_begin, __ATOMIC_RELAXED);
+        while (start < cur && !__atomic_compare_exchange_n(&__huron_heap_begin, &cur, start, true,
+                                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        cur = __atomic_load_n(&__huron_heap_end, __ATOMIC_RELAXED);
+        while (end > cur && !__atomic_compare_exchange_n(&__huron_heap_end, &cur, end, true,
+                                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED));
     }
 
     inline bool contain(uintptr_t addr) {
-        return heap.contain(addr);
+        return addr >= __atomic_load_n(&__huron_heap_begin, __ATOMIC_RELAXED) &&
+               addr < __atomic_load_n(&__huron_heap_end, __ATOMIC_RELAXED);
     }
 
-    bool find_id_offset(uintptr_t addr, size_t &id, size_t &offset) {
-        // Find the first starting address greater than `addr`, then it--
-        // to get where `addr` falls in.
-        lock.lock_shared();
-        auto it = data_alive.upper_bound(addr);
-        if (it != data_alive.begin()) {
-            it--;
-            if (it->first + it->second.size > addr) {
-                id = it->second.id;
-                offset = addr - it->first;
-                lock.unlock_shared();
-                return true;
+    bool find_id_offset(uintptr_t addr, size_t &id, size_t &offset, uint64_t *site = nullptr) {
+        EpochDomain &epochs = EpochDomain::getInstance();
+        epochs.enter(current->slot);
+        PageMap::AllocDesc desc{};
+        bool found = data_alive.find(addr, desc) || large_blocks.find(addr, desc) || regions.find(addr, desc);
+        epochs.quiesce(current->slot);
+        if (found) {
+            id = desc.id;
+            offset = addr - desc.start;
+            if (site)
+                *site = desc.site;
+        }
+        return found;
+    }
+
+private:
+    // Follows frame pointers for up to stack_depth return addresses, staying
+    // within the thread's stack, so frames built without them end the walk
+    // early instead of faulting. Return addresses in the runtime (insert, the
+    // malloc_inst family) are skipped: which of them a site goes through
+    // says nothing about the program.
+    unsigned walk_stack(void **frames) {
+        if (!stack_depth)
+            return 0;
+        static __thread uintptr_t stack_lo, stack_hi;
+        if (!stack_hi) {
+            pthread_attr_t attr;
+            void *addr;
+            size_t len;
+            if (pthread_getattr_np(pthread_self(), &attr) != 0)
+                return 0;
+            pthread_attr_getstack(&attr, &addr, &len);
+            pthread_attr_destroy(&attr);
+            stack_lo = (uintptr_t) addr, stack_hi = (uintptr_t) addr + len;
+        }
+        auto fp = (uintptr_t) __builtin_frame_address(0);
+        unsigned n = 0;
+        while (n < stack_depth && fp >= stack_lo && fp + 2 * sizeof(void *) <= stack_hi &&
+               !(fp & (sizeof(void *) - 1))) {
+            void **frame = (void **) fp;
+            if (!frame[1])
+                break;
+            if (!runtime_text.contain((uintptr_t) frame[1]))
+                frames[n++] = frame[1];
+            if ((uintptr_t) frame[0] <= fp)
+                break;
+            fp = (uintptr_t) frame[0];
+        }
+        return n;
+    }
+
+    // Finds the executable segment of the module this code is in.
+    static int find_runtime_text(dl_phdr_info *info, size_t, void *data) {
+        auto self = (uintptr_t) &find_runtime_text;
+        for (int i = 0; i < info->dlpi_phnum; i++) {
+            const ElfW(Phdr) &ph = info->dlpi_phdr[i];
+            uintptr_t start = info->dlpi_addr + ph.p_vaddr;
+            if (ph.p_type == PT_LOAD && (ph.p_flags & PF_X) && self >= start && self < start + ph.p_memsz) {
+                *(AddrSeg *) data = AddrSeg(start, start + ph.p_memsz);
+                return 1;
             }
         }
-        lock.unlock_shared();
-        return false;
+        return 0;
+    }
+
+    static uint64_t hash_frames(void *const *frames, unsigned n) {
+        uint64_t hash = 0;
+        for (unsigned i = 0; i < n; i++)
+            hash = (hash ^ (uint64_t) frames[i]) * 0x100000001b3ULL;
+        return hash;
+    }
+
+    Registry &registry_of(int slot) {
+        if ((size_t) slot >= registries.size()) {
+            std::lock_guard<std::mutex> lg(lock);
+            while (registries.size() <= (size_t) slot)
+                registries.emplace_back();
+        }
+        return registries[slot];
     }
 };
 
@@ -0,0 +1,123 @@
+#ifndef RUNTIME_OWNERSHIP_H
+#define RUNTIME_OWNERSHIP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+#include "MemArith.h"
+
+// Counted by each thread in ownership mode.
+struct OwnershipStats {
+    // Accesses that took a line away from (or shared it with) another thread.
+    uint64_t transfers;
+    // Lines that crossed the logging threshold on an access by this thread.
+    uint64_t bouncing;
+};
+
+// Optional online coherence model: one shadow word per cache line tracks the
+// last writer and the threads that read the line since, which is enough to
+// see ownership move between threads as an invalidation-based protocol would.
+// Only lines that have bounced at least `threshold` times are logged, so
+// thread-private lines cost a shadow load and no logging at all.
+// Updates are lock-free; a lost race only makes the counts approximate.
+class LineOwnership {
+    // Shadow word layout.
+    static const int COUNT_SHIFT = 16, READERS_SHIFT = 24, N_READER_BITS = 40;
+    static const uint64_t WRITER_MASK = 0xffff, COUNT_MAX = 0xff;
+    static const uint64_t READERS_MASK = ~0UL << READERS_SHIFT;
+
+    static const int LINE_BITS = 48 - cacheline_size_power, LEAF_BITS = 22;
+    static const size_t LEAF_LEN = 1UL << LEAF_BITS, ROOT_LEN = 1UL << (LINE_BITS - LEAF_BITS);
+
+    LineOwnership() : threshold(0) {}
+
+public:
+    static LineOwnership &getInstance() {
+        static char buf[sizeof(LineOwnership)];
+        static auto *theOneTrueObject = new(buf) LineOwnership();
+        return *theOneTrueObject;
+    }
+
+    // Reads HURON_OWNERSHIP: the number of transfers after which a line is
+    // logged. Unset or 0 leaves the mode off and every access is logged.
+    void init_from_env() {
+        if (const char *env = getenv("HURON_OWNERSHIP"))
+            threshold = std::min(strtoul(env, nullptr, 10), COUNT_MAX);
+    }
+
+    inline bool enabled() const {
+        return threshold != 0;
+    }
+
+    // Moves the line holding `addr` to its state after the access. Returns
+    // true if the line has bounced enough for the access to be logged.
+    inline bool access(uintptr_t addr, int thread, bool is_write, OwnershipStats &stats) {
+        std::atomic<uint64_t> *word = shadow_of(addr);
+        if (!word)
+            return true;
+        uint64_t writer = (uint64_t) thread % WRITER_MASK + 1;
+        uint64_t reader = 1UL << (READERS_SHIFT + thread % N_READER_BITS);
+        uint64_t old = word->load(std::memory_order_relaxed), count;
+        while (true) {
+            uint64_t last = old & WRITER_MASK, readers = old & READERS_MASK, next;
+            bool transfer;
+            count = (old >> COUNT_SHIFT) & COUNT_MAX;
+            if (is_write) {
+                // Every other copy of the line is invalidated.
+                transfer = (last && last != writer) || (readers & ~reader);
+                next = writer | reader;
+            } else {
+                // The line comes from the writer's cache, unless we have it already.
+                transfer = last && last != writer && !(readers & reader);
+                next = last | readers | reader;
+            }
+            if (transfer && count < COUNT_MAX)
+                count++;
+            next |= count << COUNT_SHIFT;
+            // Thread-private lines end up here without ever storing.
+            if (next == old)
+                break;
+            if (word->compare_exchange_weak(old, next, std::memory_order_relaxed)) {
+                if (transfer) {
+                    stats.transfers++;
+                    if (count == threshold)
+                        stats.bouncing++;
+                }
+                break;
+            }
+        }
+        return count >= threshold;
+    }
+
+private:
+    // Leaves cover 2^LEAF_BITS lines and are only backed where touched.
+    std::atomic<uint64_t> *shadow_of(uintptr_t addr) {
+        uintptr_t line = addr >> cacheline_size_power;
+        if (line >> LINE_BITS)
+            return nullptr;
+        std::atomic<std::atomic<uint64_t> *> &leaf_slot = root[line >> LEAF_BITS];
+        std::atomic<uint64_t> *leaf = leaf_slot.load(std::memory_order_acquire);
+        if (!leaf) {
+            void *mem = mmap(nullptr, LEAF_LEN * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (mem == MAP_FAILED) {
+                fprintf(stderr, "Cannot allocate ownership shadow!!\n");
+                abort();
+            }
+            if (leaf_slot.compare_exchange_strong(leaf, (std::atomic<uint64_t> *) mem, std::memory_order_acq_rel))
+                leaf = (std::atomic<uint64_t> *) mem;
+            else
+                munmap(mem, LEAF_LEN * sizeof(uint64_t));
+        }
+        return &leaf[line & (LEAF_LEN - 1)];
+    }
+
+    std::atomic<std::atomic<uint64_t> *> root[ROOT_LEN];
+    uint64_t threshold;
+};
+
+#endif //RUNTIME_OWNERSHIP_H
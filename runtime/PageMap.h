@@ -0,0 +1,214 @@
+#ifndef RUNTIME_PAGEMAP_H
+#define RUNTIME_PAGEMAP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <sys/mman.h>
+#include "Epoch.h"
+#include "LibFuncs.h"
+
+// Two-level radix tree (as in tcmalloc) from page number to the live
+// allocations overlapping that page.
+// Readers take no lock and write nothing shared: a lookup is two dependent
+// loads plus a binary search of an immutable page entry.
+// Writers take no lock either: they copy-on-write page entries, install them
+// with a CAS (retrying if another writer got there first) and retire the old
+// ones to EpochDomain. Writers must be online readers themselves, since they
+// read page entries other writers may retire.
+class PageMap {
+public:
+    struct AllocDesc {
+        uintptr_t start;
+        size_t size, id;
+        // Call site of the allocation, func_id << 32 | inst_id.
+        uint64_t site;
+
+        inline bool contain(uintptr_t addr) const {
+            return addr - start < size;
+        }
+    };
+
+private:
+    static const int ADDR_BITS = 48, PAGE_BITS = 12, LEAF_BITS = 18;
+    static const int ROOT_BITS = ADDR_BITS - PAGE_BITS - LEAF_BITS;
+    static const size_t LEAF_LEN = 1UL << LEAF_BITS, ROOT_LEN = 1UL << ROOT_BITS;
+
+    // Immutable once published. Sorted by start address; allocations do not
+    // overlap, so only the last one starting at or before an address can
+    // hold it.
+    struct PageEntry {
+        size_t n;
+
+        const AllocDesc *allocs() const {
+            return reinterpret_cast<const AllocDesc *>(this + 1);
+        }
+
+        AllocDesc *allocs() {
+            return reinterpret_cast<AllocDesc *>(this + 1);
+        }
+
+        // Last allocation starting at or before `addr`, if any.
+        const AllocDesc *last_before(uintptr_t addr) const {
+            const AllocDesc *it = std::upper_bound(allocs(), allocs() + n, addr,
+                                                   [](uintptr_t a, const AllocDesc &d) { return a < d.start; });
+            return it == allocs() ? nullptr : it - 1;
+        }
+
+        bool has_start(uintptr_t start) const {
+            const AllocDesc *desc = last_before(start);
+            return desc && desc->start == start;
+        }
+
+        static PageEntry *create(size_t n) {
+            auto *entry = (PageEntry *) __libc_malloc(sizeof(PageEntry) + n * sizeof(AllocDesc));
+            entry->n = n;
+            return entry;
+        }
+    };
+
+    struct Leaf {
+        std::atomic<PageEntry *> pages[LEAF_LEN];
+    };
+
+public:
+    bool find(uintptr_t addr, AllocDesc &desc) const {
+        uintptr_t page = addr >> PAGE_BITS;
+        if (page >> (ROOT_BITS + LEAF_BITS))
+            return false;
+        const Leaf *leaf = root[page >> LEAF_BITS].load(std::memory_order_acquire);
+        if (!leaf)
+            return false;
+        const PageEntry *entry = leaf->pages[page & (LEAF_LEN - 1)].load(std::memory_order_acquire);
+        if (!entry)
+            return false;
+        const AllocDesc *found = entry->last_before(addr);
+        if (!found || !found->contain(addr))
+            return false;
+        desc = *found;
+        return true;
+    }
+
+    // Writer side; `reader` is the EpochDomain slot of the calling thread.
+    void insert(int reader, const AllocDesc &desc) {
+        if (last_page(desc) >> (ROOT_BITS + LEAF_BITS))
+            return;
+        for (uintptr_t page = first_page(desc); page <= last_page(desc); page++) {
+            std::atomic<PageEntry *> &slot = get_slot(page);
+            PageEntry *old = slot.load(std::memory_order_acquire), *entry;
+            do {
+                size_t n_old = old ? old->n : 0;
+                entry = PageEntry::create(n_old + 1);
+                size_t n = 0;
+                bool placed = false;
+                for (size_t i = 0; i < n_old; i++) {
+                    const AllocDesc &other = old->allocs()[i];
+                    // Left behind by a free we did not see; the memory has been reused.
+                    if (overlap(other, desc))
+                        continue;
+                    if (!placed && desc.start < other.start) {
+                        entry->allocs()[n++] = desc;
+                        placed = true;
+                    }
+                    entry->allocs()[n++] = other;
+                }
+                if (!placed)
+                    entry->allocs()[n++] = desc;
+                entry->n = n;
+            } while (!publish(reader, slot, old, entry));
+        }
+    }
+
+    // Writer side. Removes the allocation starting exactly at `start`.
+    bool erase(int reader, uintptr_t start, AllocDesc &desc) {
+        if (!find_start(start, desc))
+            return false;
+        for (uintptr_t page = first_page(desc); page <= last_page(desc); page++) {
+            std::atomic<PageEntry *> &slot = get_slot(page);
+            PageEntry *old = slot.load(std::memory_order_acquire), *entry;
+            do {
+                // Already gone if another thread freed the same pointer.
+                if (!old || !old->has_start(desc.start))
+                    break;
+                entry = nullptr;
+                if (old->n > 1) {
+                    entry = PageEntry::create(old->n - 1);
+                    size_t n = 0;
+                    for (size_t i = 0; i < old->n; i++)
+                        if (old->allocs()[i].start != desc.start)
+                            entry->allocs()[n++] = old->allocs()[i];
+                    entry->n = n;
+                }
+            } while (!publish(reader, slot, old, entry));
+        }
+        return true;
+    }
+
+private:
+    bool find_start(uintptr_t start, AllocDesc &desc) const {
+        uintptr_t page = start >> PAGE_BITS;
+        if (page >> (ROOT_BITS + LEAF_BITS))
+            return false;
+        const Leaf *leaf = root[page >> LEAF_BITS].load(std::memory_order_acquire);
+        if (!leaf)
+            return false;
+        const PageEntry *entry = leaf->pages[page & (LEAF_LEN - 1)].load(std::memory_order_acquire);
+        if (!entry)
+            return false;
+        const AllocDesc *found = entry->last_before(start);
+        if (!found || found->start != start)
+            return false;
+        desc = *found;
+        return true;
+    }
+
+    // Installs `entry` if `slot` still holds `old`; otherwise frees `entry`
+    // and loads the current page entry into `old`.
+    static bool publish(int reader, std::atomic<PageEntry *> &slot, PageEntry *&old, PageEntry *entry) {
+        if (!slot.compare_exchange_strong(old, entry, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            __libc_free(entry);
+            return false;
+        }
+        if (old)
+            EpochDomain::getInstance().retire(reader, old);
+        return true;
+    }
+
+    std::atomic<PageEntry *> &get_slot(uintptr_t page) {
+        std::atomic<Leaf *> &leaf_slot = root[page >> LEAF_BITS];
+        Leaf *leaf = leaf_slot.load(std::memory_order_acquire);
+        if (!leaf) {
+            // Leaves are never freed; mmap'ed memory is zeroed and only backed when touched.
+            void *mem = mmap(nullptr, sizeof(Leaf), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (mem == MAP_FAILED) {
+                fprintf(stderr, "Cannot allocate page map leaf!!\n");
+                abort();
+            }
+            if (leaf_slot.compare_exchange_strong(leaf, (Leaf *) mem, std::memory_order_acq_rel))
+                leaf = (Leaf *) mem;
+            else
+                munmap(mem, sizeof(Leaf));
+        }
+        return leaf->pages[page & (LEAF_LEN - 1)];
+    }
+
+    static bool overlap(const AllocDesc &lhs, const AllocDesc &rhs) {
+        return lhs.start < rhs.start + std::max(rhs.size, 1UL) &&
+               rhs.start < lhs.start + std::max(lhs.size, 1UL);
+    }
+
+    // Zero-sized allocations still occupy the page they start on, so that
+    // they can be found by erase().
+    static uintptr_t first_page(const AllocDesc &desc) {
+        return desc.start >> PAGE_BITS;
+    }
+
+    static uintptr_t last_page(const AllocDesc &desc) {
+        return (desc.start + std::max(desc.size, 1UL) - 1) >> PAGE_BITS;
+    }
+
+    std::atomic<Leaf *> root[ROOT_LEN];
+};
+
+#endif //RUNTIME_PAGEMAP_H
@@ -0,0 +1,51 @@
+#ifndef RUNTIME_PHASES_H
+#define RUNTIME_PHASES_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// Phases of barrier-synchronized programs: the phase is the number of
+// pthread_barrier_wait rounds completed so far, and every record is
+// aggregated per (phase, address, PC), so that detection can tell lines
+// written by different threads in different phases from contended ones.
+// A round is counted once by whichever of its threads returns first. With
+// several barriers used at the same time by disjoint groups of threads,
+// phases only approximate each group's rounds.
+class BarrierPhases {
+    BarrierPhases() : on(false), phase(0) {}
+
+public:
+    static BarrierPhases &getInstance() {
+        static char buf[sizeof(BarrierPhases)];
+        static auto *theOneTrueObject = new(buf) BarrierPhases();
+        return *theOneTrueObject;
+    }
+
+    // HURON_PHASES=1 enables phases; otherwise every record is in phase 0.
+    void init_from_env() {
+        const char *env = getenv("HURON_PHASES");
+        on = env && atoi(env) != 0;
+    }
+
+    inline bool enabled() const {
+        return on;
+    }
+
+    inline uint32_t current() const {
+        return phase.load(std::memory_order_relaxed);
+    }
+
+    // Called by each thread returning from a barrier it entered in `seen`.
+    inline void passed(uint32_t seen) {
+        phase.compare_exchange_strong(seen, seen + 1, std::memory_order_relaxed);
+    }
+
+private:
+    bool on;
+    // Read on every logged access, written once per round: keep it apart.
+    alignas(64) std::atomic<uint32_t> phase;
+};
+
+#endif //RUNTIME_PHASES_H
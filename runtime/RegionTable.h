@@ -0,0 +1,122 @@
+#ifndef RUNTIME_REGIONTABLE_H
+#define RUNTIME_REGIONTABLE_H
+
+#include <algorithm>
+#include <atomic>
+#include "Epoch.h"
+#include "LibFuncs.h"
+#include "PageMap.h"
+
+// The few large ranges, such as registered regions, thread stacks and large
+// heap blocks, kept apart from the PageMap, where each would take an entry in
+// every page it spans. An immutable array sorted by start, replaced as a
+// whole on every change: readers do a binary search, writers copy-on-write
+// and install the copy with a CAS, retiring the old one to EpochDomain as
+// PageMap does.
+// Ranges do not overlap; one that overlaps an earlier one replaces it.
+class RegionTable {
+public:
+    typedef PageMap::AllocDesc AllocDesc;
+
+private:
+    struct Table {
+        size_t n;
+
+        const AllocDesc *ranges() const {
+            return reinterpret_cast<const AllocDesc *>(this + 1);
+        }
+
+        AllocDesc *ranges() {
+            return reinterpret_cast<AllocDesc *>(this + 1);
+        }
+
+        static Table *create(size_t n) {
+            auto *table = (Table *) __libc_malloc(sizeof(Table) + n * sizeof(AllocDesc));
+            table->n = n;
+            return table;
+        }
+    };
+
+public:
+    RegionTable() : table(nullptr) {}
+
+    bool find(uintptr_t addr, AllocDesc &desc) const {
+        const Table *t = table.load(std::memory_order_acquire);
+        if (!t)
+            return false;
+        const AllocDesc *end = t->ranges() + t->n;
+        const AllocDesc *it = std::upper_bound(t->ranges(), end, addr, [](uintptr_t a, const AllocDesc &d) {
+            return a < d.start;
+        });
+        if (it == t->ranges() || !(it - 1)->contain(addr))
+            return false;
+        desc = *(it - 1);
+        return true;
+    }
+
+    // Writer side; `reader` is the EpochDomain slot of the calling thread.
+    void insert(int reader, const AllocDesc &desc) {
+        Table *old = table.load(std::memory_order_acquire), *t;
+        do {
+            size_t n_old = old ? old->n : 0;
+            t = Table::create(n_old + 1);
+            size_t n = 0;
+            bool placed = false;
+            for (size_t i = 0; i < n_old; i++) {
+                const AllocDesc &other = old->ranges()[i];
+                if (overlap(other, desc))
+                    continue;
+                if (!placed && desc.start < other.start) {
+                    t->ranges()[n++] = desc;
+                    placed = true;
+                }
+                t->ranges()[n++] = other;
+            }
+            if (!placed)
+                t->ranges()[n++] = desc;
+            t->n = n;
+        } while (!publish(reader, old, t));
+    }
+
+    // Writer side. Removes the range starting exactly at `start`.
+    bool erase(int reader, uintptr_t start, AllocDesc &desc) {
+        Table *old = table.load(std::memory_order_acquire), *t;
+        do {
+            size_t i = 0;
+            while (old && i < old->n && old->ranges()[i].start != start)
+                i++;
+            if (!old || i == old->n)
+                return false;
+            desc = old->ranges()[i];
+            t = nullptr;
+            if (old->n > 1) {
+                t = Table::create(old->n - 1);
+                std::copy(old->ranges(), old->ranges() + i, t->ranges());
+                std::copy(old->ranges() + i + 1, old->ranges() + old->n, t->ranges() + i);
+            }
+        } while (!publish(reader, old, t));
+        return true;
+    }
+
+private:
+    // Installs `t` if the table is still `old`; otherwise frees `t` and
+    // loads the current table into `old`.
+    bool publish(int reader, Table *&old, Table *t) {
+        if (!table.compare_exchange_strong(old, t, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            __libc_free(t);
+            return false;
+        }
+        if (old)
+            EpochDomain::getInstance().retire(reader, old);
+        return true;
+    }
+
+    static bool overlap(const AllocDesc &lhs, const AllocDesc &rhs) {
+        return lhs.start < rhs.start + std::max(rhs.size, 1UL) &&
+               rhs.start < lhs.start + std::max(lhs.size, 1UL);
+    }
+
+    std::atomic<Table *> table;
+};
+
+#endif //RUNTIME_REGIONTABLE_H
@@ -2,12 +2,22 @@
 #include <vector>
 #include <mutex>
 #include <unordered_map>
+#include <cerrno>
 #include <csignal>
+#include <cstring>
+#include <new>
 
 #include "MemArith.h"
 #include "xthread.h"
+#include "huron.h"
 #include "GetGlobal.h"
 #include "MallocInfo.h"
+#include "Ownership.h"
+#include "Sampling.h"
+#include "Snapshot.h"
+#include "LiveMonitor.h"
+#include "Phases.h"
+#include "Tracer.h"
 
 extern "C" {
 void initializer(void) __attribute__((constructor));
@@ -16,6 +26,15 @@ void finalizer(void) __attribute__((destructor));
 void handle_access(uintptr_t addr, uint64_t func_id, uint64_t inst_id,
                    size_t size, bool is_write);
 
+// Bounds checked inline by instrumented code before calling handle_access.
+// The heap bounds start out empty and are updated by `malloc_sizes`.
+uintptr_t __huron_heap_begin = ~0LU, __huron_heap_end = 0;
+uintptr_t __huron_global_begin = 0, __huron_global_end = 0;
+// Also checked inline: HURON_MULTITHREADED is clear while only one of our
+// threads is alive, as nothing can be shared then and accesses are not worth
+// logging; HURON_SNAPSHOT_PENDING lets every access through to hand off.
+uintptr_t __huron_multithreaded = 0;
+
 void *malloc_inst(size_t size, uint64_t func_id, uint64_t inst_id);
 
 void *calloc_inst(size_t n, size_t size, uint64_t func_id, uint64_t inst_id);
@@ -25,6 +44,20 @@ void *realloc_inst(void *ptr, size_t size, uint64_t func_id, uint64_t inst_id);
 int posix_memalign_inst(void **memptr, size_t alignment, size_t size, 
                         uint64_t func_id, uint64_t inst_id);
 
+void *new_inst(size_t size, uint64_t func_id, uint64_t inst_id);
+
+void *new_nothrow_inst(size_t size, uint64_t func_id, uint64_t inst_id);
+
+void *new_aligned_inst(size_t size, size_t alignment, uint64_t func_id, uint64_t inst_id);
+
+void *new_aligned_nothrow_inst(size_t size, size_t alignment, uint64_t func_id, uint64_t inst_id);
+
+void *aligned_alloc_inst(size_t alignment, size_t size, uint64_t func_id, uint64_t inst_id);
+
+char *strdup_inst(const char *s, uint64_t func_id, uint64_t inst_id);
+
+char *strndup_inst(const char *s, size_t n, uint64_t func_id, uint64_t inst_id);
+
 void store_16bytes(uintptr_t addr, uint64_t func_id, uint64_t inst_id) {
     handle_access(addr, func_id, inst_id, 16, true);
 }
@@ -59,26 +92,68 @@ void load_1bytes(uintptr_t addr, uint64_t func_id, uint64_t inst_id) {
 
 MallocInfo malloc_sizes;
 AddrSeg global;
-std::atomic<size_t> thread0_alloc(0), total_alloc(0);
 
 void initializer(void) {
 #ifdef DEBUG
     printf("Initializing...\n");
 #endif
-    global = getGlobalRegion();
+    GlobalSymbols &globals = GlobalSymbols::getInstance();
+    globals.init_from_env();
+    global = globals.bounds();
+    __huron_global_begin = global.get_start();
+    __huron_global_end = global.get_end();
+    LineOwnership::getInstance().init_from_env();
+    BurstSampler::getInstance().init_from_env();
+    LineSampler::getInstance().init_from_env();
+    BarrierPhases::getInstance().init_from_env();
+    Tracer::getInstance().init_from_env();
+    LogWriter::getInstance().start();
     xthread::getInstance().initInitialThread();
-    current->all_hooks_active = true;
+    ThreadRegions::getInstance().init_from_env();
+    Snapshot::getInstance().init_from_env();
+    LiveMonitor::getInstance().init_from_env();
+    hot_state.all_hooks_active = true;
+}
+
+void stop_runtime_threads() {
+    Snapshot::getInstance().stop();
+    LiveMonitor::getInstance().stop();
+    LogWriter::getInstance().stop();
 }
 
 void finalizer(void) {
-    current->all_hooks_active = false;
+    hot_state.all_hooks_active = false;
+    // Runs in the thread that calls exit, usually the initial one, which
+    // never goes through Thread::finish; `current` is null if it is the last
+    // thread to exit after main() ended with pthread_exit.
+    if (current)
+        current->collect_hot();
 #ifdef DEBUG
     printf("Finalizing...\n");
-    printf("Thread 0 alloc'ed %lu bytes (accumulative) out of total %lu;\n",
-           thread0_alloc.load(), total_alloc.load());
+    if (current)
+        printf("Thread %d alloc'ed %lu bytes (accumulative) out of total %lu;\n",
+               current->index, current->allocated, xthread::getInstance().allocated_total());
+#endif
+    Snapshot::getInstance().stop();
+    LiveMonitor::getInstance().stop();
+    Tracer::getInstance().stop("trace.log");
+    xthread::getInstance().merge_logs_to("record.log");
+    LogWriter &writer = LogWriter::getInstance();
+    writer.stop();
+#ifdef DEBUG
+    printf("Log writer wrote %lu bytes; application threads blocked on it for %.3f ms;\n",
+           writer.get_bytes_written(), writer.get_blocked_ns() / 1e6);
+    if (LineOwnership::getInstance().enabled()) {
+        OwnershipStats stats = xthread::getInstance().ownership_totals();
+        printf("%lu cache line transfers; %lu lines bounced enough to be logged;\n",
+               stats.transfers, stats.bouncing);
+    }
 #endif
-    xthread::getInstance().flush_all_concat_to("record.log");
     malloc_sizes.dump("mallocRuntimeIDs.txt");
+    xthread::getInstance().dump_lifetimes("mallocRuntimeIDs.txt");
+    if (malloc_sizes.has_stacks())
+        malloc_sizes.dump_sites("mallocSites.txt");
+    GlobalSymbols::getInstance().dump_names("mallocGlobals.txt");
 }
 
 void *malloc_inst(size_t size, uint64_t func_id, uint64_t inst_id) {
@@ -87,11 +162,8 @@ void *malloc_inst(size_t size, uint64_t func_id, uint64_t inst_id) {
     // void *start_ptr = aligned_alloc(1 << cacheline_size_power, size);
     // RAII deactivate malloc hook so that we can use malloc below.
     HookDeactivator deactiv;
-    total_alloc += size;
-    // Only record thread 0.
-    if (deactiv.get_current()->index == 0) {
-        // Global, single-threaded
-        thread0_alloc += size;
+    if (start_ptr && deactiv.get_current()) {
+        hot_state.allocated += size;
         malloc_sizes.insert((uintptr_t) start_ptr, size, func_id, inst_id);
     }
     return start_ptr;
@@ -104,18 +176,21 @@ void *calloc_inst(size_t n, size_t size, uint64_t func_id, uint64_t inst_id) {
 }
 
 void *realloc_inst(void *ptr, size_t size, uint64_t func_id, uint64_t inst_id) {
-    void *new_start_ptr = __libc_realloc(ptr, size);
     // RAII deactivate malloc hook so that we can use realloc below.
     HookDeactivator deactiv;
-    total_alloc += size;
-    // Only record thread 0.
-    if (deactiv.get_current()->index == 0) {
-        thread0_alloc += size;
-        if (ptr) {
-            // Global, single-threaded
-            assert(malloc_sizes.erase((uintptr_t) ptr));
-        }
-        // Global, single-threaded
+    Thread *th = deactiv.get_current();
+    // Forget the old block before it can be handed to another thread.
+    PageMap::AllocDesc old{};
+    bool had_old = ptr && th && malloc_sizes.erase((uintptr_t) ptr, false, &old);
+    void *new_start_ptr = __libc_realloc(ptr, size);
+    // A failed realloc leaves the old block alone; realloc(ptr, 0) frees it.
+    if (!new_start_ptr) {
+        if (had_old && size)
+            malloc_sizes.restore(old);
+        return nullptr;
+    }
+    if (th) {
+        hot_state.allocated += size;
         malloc_sizes.insert((uintptr_t) new_start_ptr, size, func_id, inst_id);
     }
     return new_start_ptr;
@@ -126,20 +201,82 @@ int posix_memalign_inst(void **memptr, size_t alignment, size_t size,
     int code = __internal_posix_memalign(memptr, alignment, size);
     if (code)
         return code;
-    total_alloc += size;
     // RAII deactivate malloc hook so that we can use malloc below.
     HookDeactivator deactiv;
-    // Only record thread 0.
-    if (deactiv.get_current()->index == 0) {
-        thread0_alloc += size;
-        // Global, single-threaded
+    if (deactiv.get_current()) {
+        hot_state.allocated += size;
         malloc_sizes.insert((uintptr_t) *memptr, size, func_id, inst_id);
     }
     return code;
 }
 
+// operator new: retries through the new handler, and throws without one.
+void *new_inst(size_t size, uint64_t func_id, uint64_t inst_id) {
+    for (;;) {
+        if (void *p = malloc_inst(size ? size : 1, func_id, inst_id))
+            return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void *new_nothrow_inst(size_t size, uint64_t func_id, uint64_t inst_id) {
+    try {
+        return new_inst(size, func_id, inst_id);
+    } catch (const std::bad_alloc &) {
+        return nullptr;
+    }
+}
+
+void *new_aligned_inst(size_t size, size_t alignment, uint64_t func_id, uint64_t inst_id) {
+    for (;;) {
+        if (void *p = aligned_alloc_inst(alignment, size ? size : 1, func_id, inst_id))
+            return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void *new_aligned_nothrow_inst(size_t size, size_t alignment, uint64_t func_id, uint64_t inst_id) {
+    try {
+        return new_aligned_inst(size, alignment, func_id, inst_id);
+    } catch (const std::bad_alloc &) {
+        return nullptr;
+    }
+}
+
+// Also replaces memalign. Unlike them, posix_memalign wants at least pointer
+// alignment.
+void *aligned_alloc_inst(size_t alignment, size_t size, uint64_t func_id, uint64_t inst_id) {
+    void *p;
+    int code = posix_memalign_inst(&p, std::max(alignment, sizeof(void *)), size, func_id, inst_id);
+    if (code) {
+        errno = code;
+        return nullptr;
+    }
+    return p;
+}
+
+char *strdup_inst(const char *s, uint64_t func_id, uint64_t inst_id) {
+    return strndup_inst(s, SIZE_MAX, func_id, inst_id);
+}
+
+char *strndup_inst(const char *s, size_t n, uint64_t func_id, uint64_t inst_id) {
+    size_t len = strnlen(s, n);
+    auto *p = (char *) malloc_inst(len + 1, func_id, inst_id);
+    if (p) {
+        memcpy(p, s, len);
+        p[len] = '\0';
+    }
+    return p;
+}
+
 void *malloc(size_t size) noexcept {
-    if (current && current->all_hooks_active) {
+    if (current && hot_state.all_hooks_active) {
         HookDeactivator deactiv;
         fprintf(stderr, "Code is visiting uninstrumented malloc.\n");
     }
@@ -147,7 +284,7 @@ void *malloc(size_t size) noexcept {
 }
 
 void *calloc(size_t n, size_t size) {
-    if (current && current->all_hooks_active) {
+    if (current && hot_state.all_hooks_active) {
         HookDeactivator deactiv;
         fprintf(stderr, "Code is visiting uninstrumented calloc.\n");
     }
@@ -157,7 +294,7 @@ void *calloc(size_t n, size_t size) {
 }
 
 void *realloc(void *ptr, size_t size) {
-    if (current && current->all_hooks_active) {
+    if (current && hot_state.all_hooks_active) {
         HookDeactivator deactiv;
         fprintf(stderr, "Code is visiting uninstrumented realloc.\n");
     }
@@ -165,7 +302,7 @@ void *realloc(void *ptr, size_t size) {
 }
 
 int posix_memalign(void **memptr, size_t alignment, size_t size) {
-    if (current && current->all_hooks_active) {
+    if (current && hot_state.all_hooks_active) {
         HookDeactivator deactiv;
         fprintf(stderr, "Code is visiting uninstrumented posix_memalign "
                         "(because we don't instrument posix_memalign at this time.\n");
@@ -176,45 +313,193 @@ int posix_memalign(void **memptr, size_t alignment, size_t size) {
 void my_free_hook(void *ptr) {
     // RAII deactivate malloc hook so that we can use free below.
     HookDeactivator deactiv;
-    if (ptr && deactiv.get_current()->index == 0)
+    if (ptr && deactiv.get_current())
         malloc_sizes.erase((uintptr_t) ptr);
     __libc_free(ptr);
 }
 
 void free(void *ptr) {
-    if (current && current->all_hooks_active) {
+    if (current && hot_state.all_hooks_active) {
         my_free_hook(ptr);
         return;
     }
     __libc_free(ptr);
 }
 
+void huron_register_region(const void *ptr, size_t size, uint16_t site_tag) {
+    HookDeactivator deactiv;
+    if (deactiv.get_current())
+        malloc_sizes.insert((uintptr_t) ptr, size, (uint64_t) logfmt::FUNC_REGION, site_tag, true);
+}
+
+void huron_unregister_region(const void *ptr) {
+    HookDeactivator deactiv;
+    if (deactiv.get_current())
+        malloc_sizes.erase((uintptr_t) ptr, true);
+}
+
+void huron_object_alloc(const void *ptr, size_t size, uint16_t site_tag) {
+    HookDeactivator deactiv;
+    if (deactiv.get_current()) {
+        hot_state.allocated += size;
+        malloc_sizes.insert((uintptr_t) ptr, size, (uint64_t) logfmt::FUNC_REGION, site_tag);
+    }
+}
+
+void huron_object_free(const void *ptr) {
+    HookDeactivator deactiv;
+    if (deactiv.get_current())
+        malloc_sizes.erase((uintptr_t) ptr);
+}
+
+// Every form of delete comes down to free, so that what new_inst and the
+// others allocated is forgotten whichever one the program calls, even where
+// the C++ library would not go through our free.
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    free(ptr);
+}
+
 void handle_access(uintptr_t addr, uint64_t func_id, uint64_t inst_id,
                    size_t size, bool is_write) {
-    // If on heap:
-    if (malloc_sizes.contain(addr)) {
-        HookDeactivator deactiv;
+    static LineOwnership &ownership = LineOwnership::getInstance();
+    static const BurstSampler &sampler = BurstSampler::getInstance();
+    static const LineSampler &lines = LineSampler::getInstance();
+    static Snapshot &snapshot = Snapshot::getInstance();
+    static LiveMonitor &monitor = LiveMonitor::getInstance();
+    static const BarrierPhases &phases = BarrierPhases::getInstance();
+    static Tracer &tracer = Tracer::getInstance();
+    static const ThreadRegions &regions = ThreadRegions::getInstance();
+    static const GlobalSymbols &globals = GlobalSymbols::getInstance();
+    if (!current)
+        return;
+    if (snapshot.pending(current))
+        snapshot.hand_off(current);
+    if (!(__atomic_load_n(&__huron_multithreaded, __ATOMIC_RELAXED) & HURON_MULTITHREADED))
+        return;
+    if (regions.enabled() && regions.own(addr))
+        return;
+    // Off periods of burst sampling and unsampled lines skip the lookup entirely.
+    if (lines.enabled() && !lines.sampled(addr))
+        return;
+    if (sampler.enabled() && !sampler.sample(hot_state.burst))
+        return;
+    bool on_heap = malloc_sizes.contain(addr);
+    uint32_t var, var_offset;
+    if (!on_heap && !(global.contain(addr) && globals.find(addr, var, var_offset)))
+        return;
+    HookDeactivator deactiv;
+    Thread *th = deactiv.get_current();
+    // In ownership mode, only lines that move between threads are logged.
+    if (ownership.enabled() && !ownership.access(addr, th->index, is_write, hot_state.ownership))
+        return;
+    if (on_heap) {
         size_t m_id, m_offset;
-        bool is_recorded = malloc_sizes.find_id_offset(addr, m_id, m_offset);
+        uint64_t site;
+        bool is_recorded = malloc_sizes.find_id_offset(addr, m_id, m_offset, &site);
         if (is_recorded) {
             LocRecord rec = LocRecord(addr, (uint32_t) func_id, (uint32_t) inst_id, (uint16_t) size,
-                                      (uint32_t) m_id, (uint32_t) m_offset);
-            deactiv.get_current()->log_load_store(rec, is_write);
+                                      (uint32_t) m_id, (uint32_t) m_offset, phases.current());
+            th->log_load_store(rec, is_write);
+            if (monitor.enabled())
+                monitor.record(th->slot, th->index, addr, (int64_t) m_id, site, is_write);
+            if (tracer.enabled() && tracer.traced(site))
+                tracer.record(th->slot, th->index, addr, (uint16_t) size, is_write,
+                              (uint32_t) func_id, (uint32_t) inst_id);
         }
-    } else if (global.contain(addr)) { // If on global:
-        HookDeactivator deactiv;
-        LocRecord rec = LocRecord(addr, (uint32_t) func_id, (uint32_t) inst_id, (uint16_t) size);
-        deactiv.get_current()->log_load_store(rec, is_write);
+    } else { // If on global:
+        LocRecord rec = LocRecord::global(addr, (uint32_t) func_id, (uint32_t) inst_id, (uint16_t) size,
+                                          var, var_offset, phases.current());
+        th->log_load_store(rec, is_write);
+        if (monitor.enabled())
+            monitor.record(th->slot, th->index, addr, -1, 0, is_write);
+        if (tracer.enabled() && tracer.traced_global())
+            tracer.record(th->slot, th->index, addr, (uint16_t) size, is_write,
+                          (uint32_t) func_id, (uint32_t) inst_id);
     }
 }
 
 // Intercept the pthread_create function.
 int pthread_create(pthread_t *tid, const pthread_attr_t *attr,
                    void *(*start_routine)(void *), void *arg) {
-    if (current && current->all_hooks_active) {
+    if (current && hot_state.all_hooks_active) {
         HookDeactivator deactiv;
         int res = xthread::getInstance().thread_create(tid, attr, start_routine, arg);
         return res;
     } else
         return __internal_pthread_create(tid, attr, start_routine, arg);
 }
+
+// Threads that end with pthread_exit never return to xthread::startThread.
+// The process goes on until the other threads are done.
+void pthread_exit(void *retval) {
+    if (current)
+        xthread::getInstance().exitThread();
+    __internal_pthread_exit(retval);
+}
+
+// Threads blocked here hold no reference into the allocation maps, so they
+// go offline meanwhile: otherwise e.g. main waiting for its workers would
+// keep anything retired from being freed. The next lookup brings them back.
+int pthread_join(pthread_t thread, void **retval) {
+    if (current)
+        EpochDomain::getInstance().offline(current->slot);
+    return __internal_pthread_join(thread, retval);
+}
+
+// Each completed round starts a new phase (see Phases.h).
+int pthread_barrier_wait(pthread_barrier_t *barrier) {
+    static BarrierPhases &phases = BarrierPhases::getInstance();
+    if (current)
+        EpochDomain::getInstance().offline(current->slot);
+    if (!phases.enabled())
+        return __internal_pthread_barrier_wait(barrier);
+    uint32_t seen = phases.current();
+    int res = __internal_pthread_barrier_wait(barrier);
+    if (res == 0 || res == PTHREAD_BARRIER_SERIAL_THREAD)
+        phases.passed(seen);
+    return res;
+}
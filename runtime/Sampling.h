@@ -0,0 +1,143 @@
+#ifndef RUNTIME_SAMPLING_H
+#define RUNTIME_SAMPLING_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <x86intrin.h>
+#include "MemArith.h"
+
+// Where a thread is in its sampling bursts.
+struct BurstState {
+    bool on;
+    // Accesses left in this period, or the TSC at which it ends.
+    uint64_t left, until;
+};
+
+// Burst sampling: threads alternate between `on` periods, in which accesses
+// are looked up and logged, and `off` periods, in which they are dropped
+// before any lookup. Periods are counted in instrumented accesses of each
+// thread, or in TSC cycles; TSC periods are aligned across threads, so
+// that threads sample the same windows and still see each other's accesses.
+// Logged counts are scaled up by (on + off) / on.
+class BurstSampler {
+    BurstSampler() : on(0), off(0), period(0), use_tsc(false) {}
+
+public:
+    static BurstSampler &getInstance() {
+        static char buf[sizeof(BurstSampler)];
+        static auto *theOneTrueObject = new(buf) BurstSampler();
+        return *theOneTrueObject;
+    }
+
+    // HURON_BURST=<on>:<off> enables sampling; HURON_BURST_UNIT=tsc counts
+    // the periods in cycles instead of accesses.
+    void init_from_env() {
+        const char *burst = getenv("HURON_BURST");
+        if (!burst)
+            return;
+        char *end;
+        on = strtoul(burst, &end, 10);
+        off = *end == ':' ? strtoul(end + 1, nullptr, 10) : 0;
+        if (!on || !off) {
+            on = off = 0;
+            return;
+        }
+        period = on + off;
+        const char *unit = getenv("HURON_BURST_UNIT");
+        use_tsc = unit && !strcmp(unit, "tsc");
+    }
+
+    inline bool enabled() const {
+        return off != 0;
+    }
+
+    // True if the access falls in an on period of the thread.
+    inline bool sample(BurstState &st) const {
+        if (use_tsc) {
+            uint64_t now = __rdtsc();
+            if (now >= st.until) {
+                uint64_t phase = now % period;
+                st.on = phase < on;
+                st.until = now - phase + (st.on ? on : period);
+            }
+            return st.on;
+        }
+        if (!st.left) {
+            st.on = !st.on;
+            st.left = st.on ? on : off;
+        }
+        st.left--;
+        return st.on;
+    }
+
+    // Count seen in on periods, extrapolated to the whole run.
+    inline uint64_t scale(uint64_t count) const {
+        return enabled() ? (count * period + on / 2) / on : count;
+    }
+
+private:
+    uint64_t on, off, period;
+    bool use_tsc;
+};
+
+// Address sampling: only cache lines whose hash falls in a 1/N bucket are
+// tracked, every access to them is kept, and other lines are dropped before
+// any lookup. False sharing within a sampled line is seen exactly; detect
+// extrapolates totals by N.
+class LineSampler {
+    LineSampler() : n(1), limit(1UL << 32) {}
+
+public:
+    static LineSampler &getInstance() {
+        static char buf[sizeof(LineSampler)];
+        static auto *theOneTrueObject = new(buf) LineSampler();
+        return *theOneTrueObject;
+    }
+
+    // HURON_LINE_SAMPLE=<N> tracks one in N cache lines.
+    void init_from_env() {
+        if (const char *env = getenv("HURON_LINE_SAMPLE"))
+            n = std::max(strtoul(env, nullptr, 10), 1UL);
+        limit = (1UL << 32) / n;
+    }
+
+    inline bool enabled() const {
+        return n != 1;
+    }
+
+    uint64_t get_n() const {
+        return n;
+    }
+
+    // The same lines are picked in every run and by every thread.
+    inline bool sampled_line(uintptr_t line) const {
+        return ((uint32_t) ((line * 0x9e3779b97f4a7c15ULL) >> 32)) < limit;
+    }
+
+    inline bool sampled(uintptr_t addr) const {
+        return sampled_line(addr >> cacheline_size_power);
+    }
+
+    // True if any line of [start, start + size) is sampled.
+    bool sampled_range(uintptr_t start, size_t size) const {
+        uintptr_t first = start >> cacheline_size_power;
+        uintptr_t last = (start + std::max(size, 1UL) - 1) >> cacheline_size_power;
+        // Long enough that some line is sampled all but surely.
+        if (last - first >= 64 * n)
+            return true;
+        for (uintptr_t line = first; line <= last; line++)
+            if (sampled_line(line))
+                return true;
+        return false;
+    }
+
+private:
+    uint64_t n;
+    // Lines whose 32-bit hash is below this are sampled.
+    uint64_t limit;
+};
+
+#endif //RUNTIME_SAMPLING_H
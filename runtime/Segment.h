@@ -18,7 +18,7 @@ public:
         if (rhs.start <= start && rhs.end > start) {
             start = rhs.end;
         }
-        else if (rhs.start < end && rhs.end >= start) {
+        else if (rhs.start < end && rhs.end >= end) {
             end = rhs.start;
         }
     }
@@ -31,6 +31,10 @@ public:
         return start;
     }
 
+    T get_end() const {
+        return end;
+    }
+
     T get_size() const {
         return end - start;
     }
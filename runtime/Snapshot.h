@@ -0,0 +1,155 @@
+#ifndef RUNTIME_SNAPSHOT_H
+#define RUNTIME_SNAPSHOT_H
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "xthread.h"
+#include "MallocInfo.h"
+
+extern MallocInfo malloc_sizes;
+
+// Writes the profile of a process that is still running, for programs that
+// never get to the finalizer. A snapshot is asked for with a signal or by
+// creating a control file; a background thread then bumps the snapshot
+// generation, each thread hands what it has aggregated to its log at its
+// next instrumented access (a safe point, see hand_off), and the logs up to
+// those points are written next to the allocations as
+// record_snapshot<N>.log and mallocRuntimeIDs_snapshot<N>.txt.
+// Threads that do not get to a safe point in time (e.g. blocked in a system
+// call) are left out of that snapshot.
+class Snapshot {
+    // How long a snapshot waits for the threads to hand off.
+    static const int HAND_OFF_TIMEOUT_MS = 1000;
+    // How often the control file is looked for.
+    static const int POLL_MS = 200;
+
+    Snapshot() : requested(0), wake{-1, -1}, control_file(nullptr), reset(false),
+                 running(false), stopping(false), thread() {}
+
+public:
+    static Snapshot &getInstance() {
+        static char buf[sizeof(Snapshot)];
+        static auto *theOneTrueObject = new(buf) Snapshot();
+        return *theOneTrueObject;
+    }
+
+    // HURON_SNAPSHOT_SIGNAL=<signo> and/or HURON_SNAPSHOT_FILE=<path> enable
+    // snapshots; HURON_SNAPSHOT_RESET=1 makes each one cover only what was
+    // logged since the previous one (the allocations are always all there).
+    void init_from_env() {
+        const char *signal_env = getenv("HURON_SNAPSHOT_SIGNAL");
+        control_file = getenv("HURON_SNAPSHOT_FILE");
+        if (!signal_env && !control_file)
+            return;
+        const char *reset_env = getenv("HURON_SNAPSHOT_RESET");
+        reset = reset_env && atoi(reset_env) != 0;
+        if (pipe2(wake, O_NONBLOCK | O_CLOEXEC) != 0) {
+            fprintf(stderr, "Cannot set up snapshots!!\n");
+            return;
+        }
+        if (signal_env) {
+            struct sigaction sa{};
+            sa.sa_handler = on_signal;
+            sa.sa_flags = SA_RESTART;
+            sigemptyset(&sa.sa_mask);
+            if (sigaction(atoi(signal_env), &sa, nullptr) != 0)
+                fprintf(stderr, "Cannot catch snapshot signal %s!!\n", signal_env);
+        }
+        running = __internal_pthread_create(&thread, nullptr, run, this) == 0;
+        if (!running)
+            fprintf(stderr, "Cannot start snapshot thread!!\n");
+    }
+
+    // Called before the final logs are written.
+    void stop() {
+        if (!running)
+            return;
+        stopping.store(true);
+        char c = 0;
+        if (write(wake[1], &c, 1) < 0 && errno != EAGAIN)
+            fprintf(stderr, "Cannot stop snapshot thread!!\n");
+        pthread_join(thread, nullptr);
+        running = false;
+    }
+
+    // True if `th` has not handed its log to the latest snapshot yet.
+    inline bool pending(const Thread *th) const {
+        return th->snapshot_seen.load(std::memory_order_relaxed) != requested.load(std::memory_order_relaxed);
+    }
+
+    // Safe point of the calling thread: nothing of its own is half-updated.
+    void hand_off(Thread *th) {
+        HookDeactivator deactiv;
+        th->hand_off(requested.load(std::memory_order_acquire));
+    }
+
+private:
+    static void on_signal(int) {
+        int saved = errno;
+        char c = 0;
+        // A full pipe already has a snapshot coming.
+        if (write(getInstance().wake[1], &c, 1) < 0) {}
+        errno = saved;
+    }
+
+    static void *run(void *arg) {
+        auto *self = (Snapshot *) arg;
+        while (!self->stopping.load()) {
+            pollfd pfd{self->wake[0], POLLIN, 0};
+            bool take = poll(&pfd, 1, self->control_file ? POLL_MS : -1) > 0;
+            char drain[64];
+            while (read(self->wake[0], drain, sizeof(drain)) > 0);
+            if (self->stopping.load())
+                break;
+            if (self->control_file && access(self->control_file, F_OK) == 0) {
+                unlink(self->control_file);
+                take = true;
+            }
+            if (take)
+                self->take();
+        }
+        return nullptr;
+    }
+
+    void take() {
+        uint64_t gen = requested.fetch_add(1, std::memory_order_acq_rel) + 1;
+        std::string suffix = "_snapshot" + std::to_string(gen);
+        // Instrumented code skips handle_access while single-threaded.
+        __atomic_fetch_or(&__huron_multithreaded, HURON_SNAPSHOT_PENDING, __ATOMIC_RELAXED);
+        size_t left_out = xthread::getInstance().snapshot_logs_to(
+                "record" + suffix + ".log", gen, reset ? &begins : nullptr, HAND_OFF_TIMEOUT_MS);
+        __atomic_fetch_and(&__huron_multithreaded, ~HURON_SNAPSHOT_PENDING, __ATOMIC_RELAXED);
+        // After the logs, so that every allocation they refer to is there.
+        std::string malloc_name = "mallocRuntimeIDs" + suffix + ".txt";
+        malloc_sizes.dump(malloc_name.c_str());
+        xthread::getInstance().dump_lifetimes(malloc_name.c_str());
+        if (left_out)
+            fprintf(stderr, "%lu thread(s) left out of snapshot %lu: no safe point in time!!\n",
+                    left_out, gen);
+#ifdef DEBUG
+        printf("Snapshot %lu written;\n", gen);
+#endif
+    }
+
+    std::atomic<uint64_t> requested;
+    // Self-pipe waking the snapshot thread from the signal handler.
+    int wake[2];
+    const char *control_file;
+    bool reset;
+    // Where each slot's next segment starts in reset mode.
+    std::vector<uint64_t> begins;
+    bool running;
+    std::atomic<bool> stopping;
+    pthread_t thread;
+};
+
+#endif //RUNTIME_SNAPSHOT_H
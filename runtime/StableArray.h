@@ -0,0 +1,57 @@
+#ifndef RUNTIME_STABLEARRAY_H
+#define RUNTIME_STABLEARRAY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+// Append-only array whose elements never move: storage grows by whole chunks
+// reached through a fixed directory, so growing costs the same however many
+// elements there already are, and readers need no lock.
+// Appends must be serialized by the caller.
+template<typename T, size_t CHUNK_POWER = 6, size_t DIR_POWER = 12>
+class StableArray {
+public:
+    static const size_t CHUNK_SIZE = 1UL << CHUNK_POWER;
+    static const size_t MAX_SIZE = CHUNK_SIZE << DIR_POWER;
+
+    StableArray() : n(0) {
+        for (auto &chunk: dir)
+            chunk.store(nullptr, std::memory_order_relaxed);
+    }
+
+    // Only elements below size() may be accessed.
+    inline T &operator[](size_t i) {
+        return dir[i >> CHUNK_POWER].load(std::memory_order_acquire)[i & (CHUNK_SIZE - 1)];
+    }
+
+    size_t size() const {
+        return n.load(std::memory_order_acquire);
+    }
+
+    template<typename... Args>
+    T &emplace_back(Args &&... args) {
+        size_t i = n.load(std::memory_order_relaxed);
+        if (i == MAX_SIZE) {
+            fprintf(stderr, "StableArray is full at %lu elements!!\n", MAX_SIZE);
+            abort();
+        }
+        T *chunk = dir[i >> CHUNK_POWER].load(std::memory_order_relaxed);
+        if (!chunk) {
+            chunk = (T *) ::operator new(sizeof(T) * CHUNK_SIZE, std::align_val_t(alignof(T)));
+            dir[i >> CHUNK_POWER].store(chunk, std::memory_order_release);
+        }
+        T *elem = new(chunk + (i & (CHUNK_SIZE - 1))) T(std::forward<Args>(args)...);
+        n.store(i + 1, std::memory_order_release);
+        return *elem;
+    }
+
+private:
+    std::atomic<T *> dir[1UL << DIR_POWER];
+    std::atomic<size_t> n;
+};
+
+#endif //RUNTIME_STABLEARRAY_H
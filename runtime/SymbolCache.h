@@ -21,7 +21,8 @@ class SymbolCache {
         if (begin == std::string::npos)
             return symbol;
         size_t end = symbol_str.find('+', begin);
-        if (end == std::string::npos)
+        // No symbol name (e.g. "binary(+0x1234)"): keep the module and offset.
+        if (end == std::string::npos || end == begin + 1)
             return symbol;
         symbol_str = symbol_str.substr(begin + 1, end - begin - 1);
         const std::unique_ptr<char, decltype(&std::free)> demangled(
@@ -0,0 +1,112 @@
+#ifndef RUNTIME_THREADREGIONS_H
+#define RUNTIME_THREADREGIONS_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <link.h>
+#include <pthread.h>
+#include "LogFormat.h"
+#include "LoggingThread.h"
+#include "MallocInfo.h"
+
+extern MallocInfo malloc_sizes;
+
+// Tracks the stack and static TLS block of each of our threads as if they
+// were allocations (with M_FUNC FUNC_STACK or FUNC_TLS, and M_INST the
+// owner's id), so that data a thread keeps there and hands to others, such
+// as per-thread argument structs, gets profiled. Only the other threads'
+// accesses to a region are logged.
+// Registering a region widens the bounds of the inline heap check to the
+// stacks, so instrumented code calls into the runtime for many more accesses.
+class ThreadRegions {
+    // Only the top of a larger stack is tracked.
+    static const size_t MAX_STACK = 1UL << 26;
+
+    ThreadRegions() : on(false), tls_size(0) {}
+
+public:
+    static ThreadRegions &getInstance() {
+        static char buf[sizeof(ThreadRegions)];
+        static auto *theOneTrueObject = new(buf) ThreadRegions();
+        return *theOneTrueObject;
+    }
+
+    // HURON_STACKS=1 enables tracking.
+    void init_from_env() {
+        const char *env = getenv("HURON_STACKS");
+        on = env && atoi(env) != 0;
+        if (on)
+            dl_iterate_phdr(add_tls_size, &tls_size);
+    }
+
+    inline bool enabled() const {
+        return on;
+    }
+
+    // Registers the regions of the calling thread, if not done yet, with
+    // hooks deactivated.
+    void enter() {
+        if (!on || hot_state.stack_hi)
+            return;
+        pthread_attr_t attr;
+        void *addr;
+        size_t len;
+        if (pthread_getattr_np(pthread_self(), &attr) != 0)
+            return;
+        pthread_attr_getstack(&attr, &addr, &len);
+        pthread_attr_destroy(&attr);
+        uintptr_t hi = (uintptr_t) addr + len;
+        // On x86-64 the static TLS blocks sit right below the thread pointer;
+        // glibc puts them at the top of the stack of the threads it creates.
+        uintptr_t tp;
+        asm("mov %%fs:0, %0" : "=r"(tp));
+        if (tls_size && tp > (uintptr_t) addr && tp <= hi)
+            hi = tp - tls_size;
+        uintptr_t lo = hi - std::min(hi - (uintptr_t) addr, MAX_STACK);
+        malloc_sizes.insert(lo, hi - lo, (uint64_t) logfmt::FUNC_STACK, (uint64_t) current->index, true);
+        hot_state.stack_lo = lo, hot_state.stack_hi = hi;
+        if (tls_size) {
+            malloc_sizes.insert(tp - tls_size, tls_size, (uint64_t) logfmt::FUNC_TLS, (uint64_t) current->index,
+                                true);
+            hot_state.tls_lo = tp - tls_size, hot_state.tls_hi = tp;
+        }
+    }
+
+    // The calling thread is exiting, with hooks deactivated.
+    void leave() {
+        if (!on)
+            return;
+        if (hot_state.stack_hi)
+            malloc_sizes.erase(hot_state.stack_lo, true);
+        if (hot_state.tls_hi)
+            malloc_sizes.erase(hot_state.tls_lo, true);
+        hot_state.stack_lo = hot_state.stack_hi = hot_state.tls_lo = hot_state.tls_hi = 0;
+    }
+
+    // True for the calling thread's own regions.
+    inline bool own(uintptr_t addr) const {
+        return (addr >= hot_state.stack_lo && addr < hot_state.stack_hi) ||
+               (addr >= hot_state.tls_lo && addr < hot_state.tls_hi);
+    }
+
+private:
+    // Adds up the TLS segments of the modules loaded at startup, which all
+    // go in the static block.
+    static int add_tls_size(dl_phdr_info *info, size_t, void *data) {
+        auto *size = (size_t *) data;
+        for (int i = 0; i < info->dlpi_phnum; i++) {
+            const ElfW(Phdr) &ph = info->dlpi_phdr[i];
+            if (ph.p_type != PT_TLS)
+                continue;
+            size_t align = ph.p_align ? ph.p_align : 1;
+            *size = (*size + ph.p_memsz + align - 1) / align * align;
+        }
+        return 0;
+    }
+
+    bool on;
+    size_t tls_size;
+};
+
+#endif //RUNTIME_THREADREGIONS_H
@@ -0,0 +1,67 @@
+#ifndef RUNTIME_TRACEFORMAT_H
+#define RUNTIME_TRACEFORMAT_H
+
+#include <atomic>
+#include <cstdint>
+
+// Layout of the access rings written in trace mode (HURON_TRACE) and merged
+// into a time-ordered trace by `postprocess trace`.
+//
+// Each thread slot has a ring of fixed-size events in a memory-mapped file:
+// a RingHeader, then `capacity` events. Event i goes to index i % capacity,
+// so a full ring keeps the latest `capacity` events; `written` counts all of
+// them. The files are concatenated into trace.log at exit, and can be read
+// as they are if the process dies first.
+namespace trace {
+
+const uint32_t MAGIC = 0x54525548;  // "HURT"
+// Version 2 widened Event::thread over what was a zero field, so version 1
+// rings read the same.
+const uint32_t VERSION = 2;
+
+struct RingHeader {
+    uint32_t magic, version;
+    // log2 of the cache line size the events were split by.
+    uint32_t line_power, reserved;
+    uint64_t capacity;
+    std::atomic<uint64_t> written;
+};
+
+// One access, in 24 bytes.
+struct Event {
+    uint64_t tsc;
+    // Cache line << 16 | offset in the line << 8 | size << 1 | is_write.
+    uint64_t where;
+    // Instrumenter ids of the accessing instruction.
+    uint16_t func, inst;
+    // Thread ids are never reused, so they outgrow 16 bits in long runs.
+    uint32_t thread;
+
+    static Event make(uint64_t tsc, uintptr_t addr, int line_power, uint16_t size, bool is_write,
+                      uint32_t func, uint32_t inst, int thread) {
+        uint64_t where = ((uint64_t) (addr >> line_power) << 16) |
+                         ((addr & ((1UL << line_power) - 1)) << 8) | ((uint64_t) (size & 0x7f) << 1) | is_write;
+        return Event{tsc, where, (uint16_t) func, (uint16_t) inst, (uint32_t) thread};
+    }
+
+    inline uintptr_t addr(int line_power) const {
+        return ((where >> 16) << line_power) | ((where >> 8) & 0xff);
+    }
+
+    inline uint16_t size() const {
+        return (uint16_t) ((where >> 1) & 0x7f);
+    }
+
+    inline bool is_write() const {
+        return where & 1;
+    }
+};
+
+// Ring size in bytes.
+inline uint64_t ring_bytes(uint64_t capacity) {
+    return sizeof(RingHeader) + capacity * sizeof(Event);
+}
+
+}
+
+#endif //RUNTIME_TRACEFORMAT_H
@@ -0,0 +1,164 @@
+#ifndef RUNTIME_TRACER_H
+#define RUNTIME_TRACER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <x86intrin.h>
+#include "MemArith.h"
+#include "StableArray.h"
+#include "TraceFormat.h"
+
+// Trace mode: besides the aggregated log, every access to the allocations
+// of a few chosen sites goes, in order and with its TSC, to the ring of its
+// thread slot (see TraceFormat.h). Rings are preallocated and memory-mapped,
+// so recording an event is a store and a counter bump.
+class Tracer {
+    struct Ring {
+        trace::RingHeader *header;
+        trace::Event *events;
+    };
+
+    Tracer() : capacity(1 << 20), trace_globals(false), running(false) {}
+
+public:
+    static Tracer &getInstance() {
+        static char buf[sizeof(Tracer)];
+        static auto *theOneTrueObject = new(buf) Tracer();
+        return *theOneTrueObject;
+    }
+
+    // HURON_TRACE=<file> traces the allocation sites listed in the file, one
+    // "func,inst" (Instrumenter ids, as in the malloc file) or "global" per
+    // line; HURON_TRACE_EVENTS=<N> keeps the last N events of each slot.
+    void init_from_env() {
+        const char *path = getenv("HURON_TRACE");
+        if (!path)
+            return;
+        if (const char *events = getenv("HURON_TRACE_EVENTS"))
+            capacity = std::max<uint64_t>(strtoul(events, nullptr, 10), 1);
+        FILE *file = fopen(path, "r");
+        if (!file) {
+            fprintf(stderr, "Cannot open trace sites %s!!\n", path);
+            return;
+        }
+        char line[256];
+        while (fgets(line, sizeof(line), file)) {
+            unsigned long func, inst;
+            if (!strncmp(line, "global", 6))
+                trace_globals = true;
+            else if (sscanf(line, "%lu%*[, ]%lu", &func, &inst) == 2)
+                sites.push_back(func << 32 | inst);
+        }
+        fclose(file);
+        std::sort(sites.begin(), sites.end());
+        running = !sites.empty() || trace_globals;
+    }
+
+    inline bool enabled() const {
+        return running;
+    }
+
+    // `site` as in AllocDesc: func << 32 | inst.
+    inline bool traced(uint64_t site) const {
+        return std::binary_search(sites.begin(), sites.end(), site);
+    }
+
+    inline bool traced_global() const {
+        return trace_globals;
+    }
+
+    void record(int slot, int thread, uintptr_t addr, uint16_t size, bool is_write,
+                uint32_t func, uint32_t inst) {
+        Ring &ring = ring_of(slot);
+        if (!ring.header)
+            return;
+        uint64_t i = ring.header->written.load(std::memory_order_relaxed);
+        ring.events[i % capacity] = trace::Event::make(__rdtsc(), addr, cacheline_size_power, size, is_write,
+                                                       func, inst, thread);
+        ring.header->written.store(i + 1, std::memory_order_release);
+    }
+
+    // Concatenates the rings, without their unused part, into `output_name`.
+    // Called once every thread is done.
+    void stop(const char *output_name) {
+        if (!running)
+            return;
+        running = false;
+        FILE *out = fopen(output_name, "w");
+        if (!out)
+            fprintf(stderr, "Cannot open file!!\n");
+        for (size_t i = 0; i < rings.size(); i++) {
+            Ring &ring = rings[i];
+            if (!ring.header)
+                continue;
+            uint64_t written = ring.header->written.load();
+            if (out && written) {
+                trace::RingHeader header{trace::MAGIC, trace::VERSION, (uint32_t) cacheline_size_power, 0,
+                                         std::min(written, capacity), {written}};
+                fwrite(&header, sizeof(header), 1, out);
+                fwrite(ring.events, sizeof(trace::Event), header.capacity, out);
+            }
+            munmap(ring.header, trace::ring_bytes(capacity));
+            unlink(ring_name(i).c_str());
+        }
+        if (out)
+            fclose(out);
+    }
+
+private:
+    static std::string ring_name(size_t slot) {
+        return "__trace__" + std::to_string(slot) + ".log";
+    }
+
+    Ring &ring_of(int slot) {
+        if ((size_t) slot < rings.size())
+            return rings[slot];
+        std::lock_guard<std::mutex> lg(lock);
+        while (rings.size() <= (size_t) slot)
+            rings.emplace_back(map_ring(rings.size()));
+        return rings[slot];
+    }
+
+    // A ring that could not be mapped has no header; its slot is not traced.
+    Ring map_ring(size_t slot) {
+        std::string name = ring_name(slot);
+        uint64_t bytes = trace::ring_bytes(capacity);
+        int fd = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, (off_t) bytes) != 0) {
+            fprintf(stderr, "Cannot create trace ring %s!!\n", name.c_str());
+            if (fd >= 0)
+                close(fd);
+            return Ring{nullptr, nullptr};
+        }
+        void *mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "Cannot map trace ring %s!!\n", name.c_str());
+            return Ring{nullptr, nullptr};
+        }
+        auto *header = new(mem) trace::RingHeader{trace::MAGIC, trace::VERSION,
+                                                  (uint32_t) cacheline_size_power, 0, capacity, {0}};
+        return Ring{header, (trace::Event *) (header + 1)};
+    }
+
+    uint64_t capacity;
+    // Sorted.
+    std::vector<uint64_t> sites;
+    bool trace_globals;
+    bool running;
+    StableArray<Ring> rings;
+    // Only taken to add rings, once per thread slot.
+    std::mutex lock;
+};
+
+#endif //RUNTIME_TRACER_H
@@ -0,0 +1,40 @@
+#ifndef RUNTIME_HURON_H
+#define RUNTIME_HURON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// For programs that manage memory themselves, such as arena and slab
+// allocators on top of mmap: they hand their memory to the runtime here,
+// and it is then profiled like heap blocks, each region or object with an
+// id of its own and accesses located by offset in it. Detection reports
+// them by `site_tag`, which takes the place of the call site number the
+// Instrumenter gives to malloc calls. Calls from threads the runtime does not
+// know about are ignored.
+// Registering a region (or an object) widens the bounds of the inline heap
+// check to it. Memory mapped far from the heap, as arenas usually are, pulls
+// in the libraries and thread stacks in between, so instrumented code then
+// calls into the runtime for most accesses.
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A region of memory, e.g. a whole arena. Regions do not nest: one that
+// overlaps an earlier one replaces it.
+void huron_register_region(const void *ptr, size_t size, uint16_t site_tag);
+
+void huron_unregister_region(const void *ptr);
+
+// An object carved out of a region (or out of any memory), e.g. on a pool
+// allocation; accesses to it are told apart from the rest of the region.
+// Objects do not nest either, and freeing one is reported with
+// huron_object_free, as free does for heap blocks.
+void huron_object_alloc(const void *ptr, size_t size, uint16_t site_tag);
+
+void huron_object_free(const void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //RUNTIME_HURON_H
@@ -27,6 +27,7 @@ Allocate and manage thread index.
 #ifndef _XTHREAD_H_
 #define _XTHREAD_H_
 
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <new>
@@ -35,20 +36,35 @@ Allocate and manage thread index.
 #include <dlfcn.h>
 #include <cstring>
 #include <cstdlib>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "LoggingThread.h"
 #include "LibFuncs.h"
-
-const int MAX_THREADS = 1 << 7;
+#include "Epoch.h"
+#include "ThreadRegions.h"
 
 __thread Thread *current;
 
+__thread HotState hot_state;
+
+// Flags read by the inline filter (see Runtime.cpp).
+extern "C" uintptr_t __huron_multithreaded;
+
+// More than one of our threads is alive: accesses in bounds are logged.
+const uintptr_t HURON_MULTITHREADED = 1;
+// A snapshot waits for the threads to hand off: every access calls in.
+const uintptr_t HURON_SNAPSHOT_PENDING = 2;
+
+// In Runtime.cpp: stops the runtime's own threads, which would otherwise keep
+// the process alive once the program's are gone.
+void stop_runtime_threads();
+
 class xthread {
 private:
-    xthread() : _aliveThreads(1) {
-        // Reserve space, don't allow the vector to move around.
-        _threads.reserve(MAX_THREADS);
-    }
+    xthread() : _aliveThreads(1), _nextIndex(0), _logSingle(false) {}
 
 public:
     static xthread &getInstance() {
@@ -59,64 +75,306 @@ public:
 
     // Initialize the first threadd
     void initInitialThread() {
-        // Insert a thread in the vector and `current`
-        _threads.emplace_back(0, nullptr, nullptr);
-        current = &_threads.back();
+        std::lock_guard<std::mutex> lg(_lock);
+        current = allocThread(nullptr, nullptr);
+        // HURON_LOG_SINGLE=1 logs single-threaded phases too.
+        const char *log_single = getenv("HURON_LOG_SINGLE");
+        _logSingle = log_single && atoi(log_single) != 0;
+        setMultithreaded();
     }
 
     /// Create the wrapper 
     /// @ Intercepting the thread_creation operation.
     int thread_create(pthread_t *tid, const pthread_attr_t *attr, threadFunction *fn, void *arg) {
-        std::lock_guard<std::mutex> lg(_lock);
-
-        if (_threads.size() >= MAX_THREADS) {
-            fprintf(stderr, "Set xdefines::MAX_THREADS to larger. _alivethreads %d MAX_THREADS %d",
-                    _aliveThreads, MAX_THREADS);
-            abort();
+        // The initial thread's regions wait until it has company (and until
+        // malloc_sizes is surely constructed).
+        ThreadRegions::getInstance().enter();
+        Thread *children;
+        {
+            std::lock_guard<std::mutex> lg(_lock);
+            children = allocThread(fn, arg);
+            _aliveThreads++;
+            setMultithreaded();
         }
-        // Insert a thread.
-        _threads.emplace_back(_threads.size(), fn, arg);
-        Thread *children = &_threads.back();
         // Run it starting from the wrapper.
-        _aliveThreads++;
         int result = __internal_pthread_create(tid, attr, startThread, (void *) children);
-
+        if (result)
+            xthread::getInstance().removeThread(children);
         return result;
     }
 
     // @Global entry of all entry function.
     static void *startThread(void *arg) {
         current = (Thread *) arg;
+        hot_state.all_hooks_active = true;
+        {
+            HookDeactivator deactiv;
+            ThreadRegions::getInstance().enter();
+        }
         // Get current from the TLS storage. Start the thread main routine.
         void *result = current->startRoutine(current->startArg);
-        // We are done. Remove one thread.
-        xthread::getInstance().removeThread();
+        xthread::getInstance().exitThread();
         return result;
     }
 
-    void flush_all_concat_to(const std::string &output_name) {
-        assert(current->index == 0);
-        // Ask all threads to stop writing, and append files together.
-        for (auto &th: _threads) {
+    // The calling thread is done: its routine returned or it called
+    // pthread_exit (the initial thread too, e.g. at the end of main()). The
+    // last one stops the runtime's threads, so that the process can exit.
+    void exitThread() {
+        {
+            HookDeactivator deactiv;
+            ThreadRegions::getInstance().leave();
+        }
+        // No more heap lookups from this thread.
+        EpochDomain::getInstance().offline(current->slot);
+        // Keep what it logged, then give the slot away; anything running after
+        // this point in the thread (e.g. TLS destructors) is not logged.
+        Thread *self = current;
+        {
+            HookDeactivator deactiv;
+            self->finish();
+        }
+        current = nullptr;
+        // We are done. Remove one thread.
+        if (removeThread(self))
+            stop_runtime_threads();
+    }
+
+    // Stops logging in all threads and merges their logs into a container
+    // (see LogFormat.h) at `output_name`, with one segment per thread. Called
+    // once the other threads are done, from whichever thread exits last.
+    void merge_logs_to(const std::string &output_name) {
+        std::vector<Range> ranges;
+        for (size_t i = 0; i < _threads.size(); i++) {
+            Thread &th = _threads[i];
             th.stop_logging();
-            std::string cat_cmd = "cat " + th.get_filename() + " >> " + output_name;
-            system(cat_cmd.c_str());
-            std::string rm_cmd = "rm " + th.get_filename();
-            system(rm_cmd.c_str());
+            struct stat st{};
+            if (stat(th.get_filename().c_str(), &st) != 0)
+                st.st_size = 0;
+            ranges.push_back(Range{th.slot, 0, (uint64_t) st.st_size});
+        }
+        write_container(output_name, ranges);
+        for (size_t i = 0; i < _threads.size(); i++)
+            unlink(_threads[i].get_filename().c_str());
+    }
+
+    // Waits (up to `timeout_ms`) for every slot to hand its log to snapshot
+    // `gen`, and writes what they had logged at that point as a container at
+    // `output_name`. Slots of exited threads are handed off here. With
+    // `begins`, each slot's segment starts where its previous snapshot ended.
+    // Returns the number of slots left out because their thread never got to
+    // a safe point.
+    size_t snapshot_logs_to(const std::string &output_name, uint64_t gen,
+                            std::vector<uint64_t> *begins, int timeout_ms) {
+        size_t n_threads = _threads.size();
+        std::vector<bool> done(n_threads);
+        size_t n_done = 0;
+        for (int waited = 0; n_done < n_threads; waited++) {
+            for (size_t i = 0; i < n_threads; i++) {
+                if (done[i])
+                    continue;
+                Thread &th = _threads[i];
+                if (th.snapshot_seen.load(std::memory_order_acquire) != gen) {
+                    std::lock_guard<std::mutex> lg(_lock);
+                    // No thread can take the slot while we hold the lock.
+                    if (std::find(_freeSlots.begin(), _freeSlots.end(), th.slot) == _freeSlots.end())
+                        continue;
+                    th.hand_off(gen);
+                }
+                done[i] = true;
+                n_done++;
+            }
+            if (n_done == n_threads || waited >= timeout_ms)
+                break;
+            usleep(1000);
+        }
+        if (begins)
+            begins->resize(n_threads, 0);
+        std::vector<Range> ranges;
+        for (size_t i = 0; i < n_threads; i++) {
+            if (!done[i])
+                continue;
+            uint64_t begin = begins ? (*begins)[i] : 0;
+            ranges.push_back(Range{(int) i, begin, _threads[i].snapshot_end});
+            if (begins)
+                (*begins)[i] = _threads[i].snapshot_end;
+        }
+        write_container(output_name, ranges);
+        return n_threads - n_done;
+    }
+
+    OwnershipStats ownership_totals() {
+        OwnershipStats total{0, 0};
+        for (size_t i = 0; i < _threads.size(); i++) {
+            total.transfers += _threads[i].ownership.transfers;
+            total.bouncing += _threads[i].ownership.bouncing;
         }
-        // std::string wc_out_cmd = "wc -l " + output_name;
-        // system(wc_out_cmd.c_str());
+        return total;
+    }
+
+    uint64_t allocated_total() {
+        uint64_t total = 0;
+        for (size_t i = 0; i < _threads.size(); i++)
+            total += _threads[i].allocated;
+        return total;
+    }
+
+    // Appends when each thread ran (a THREADS block, see LogFormat.h) to the
+    // malloc file at `path`; threads still running have no end.
+    void dump_lifetimes(const char *path) {
+        using namespace logfmt;
+        BlockWriter block(THREADS, T_NCOLS);
+        {
+            std::lock_guard<std::mutex> lg(_lock);
+            for (size_t i = 0; i < _lifetimes.size(); i++) {
+                block[T_INDEX].put(i);
+                block[T_START].put(_lifetimes[i].start);
+                block[T_END].put(_lifetimes[i].end);
+                block.end_row();
+            }
+        }
+        FILE *file = fopen(path, "a");
+        if (!file) {
+            fprintf(stderr, "Cannot open file!!\n");
+            return;
+        }
+        block.flush_to(file);
+        fclose(file);
     }
 
 private:
-    void removeThread() {
+    // CLOCK_MONOTONIC times of a thread, by id; end is 0 while it runs.
+    struct Lifetime {
+        uint64_t start, end;
+    };
+
+    static uint64_t now_ns() {
+        timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    }
+
+    // Bytes [begin, end) of the log file of a slot.
+    struct Range {
+        int slot;
+        uint64_t begin, end;
+    };
+
+    void write_container(const std::string &output_name, const std::vector<Range> &ranges) {
+        std::vector<logfmt::SegmentEntry> segments;
+        uint64_t offset = sizeof(logfmt::ContainerHeader) + ranges.size() * sizeof(logfmt::SegmentEntry);
+        for (const auto &range: ranges) {
+            segments.push_back(logfmt::SegmentEntry{(uint64_t) range.slot, offset, range.end - range.begin});
+            offset += range.end - range.begin;
+        }
+        int out_fd = open(output_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            fprintf(stderr, "Cannot open file!!\n");
+            return;
+        }
+        logfmt::ContainerHeader header{logfmt::CONTAINER_MAGIC, logfmt::VERSION, 0, segments.size()};
+        std::vector<uint8_t> index((uint8_t *) &header, (uint8_t *) (&header + 1));
+        index.insert(index.end(), (uint8_t *) segments.data(), (uint8_t *) (segments.data() + segments.size()));
+        bool ok = copy_range(-1, 0, index.data(), out_fd, 0, index.size());
+        for (size_t i = 0; i < ranges.size(); i++) {
+            if (!segments[i].length)
+                continue;
+            int in_fd = open(_threads[ranges[i].slot].get_filename().c_str(), O_RDONLY);
+            if (in_fd < 0) {
+                fprintf(stderr, "Cannot read log of thread slot %d!!\n", ranges[i].slot);
+                ok = false;
+                continue;
+            }
+            ok &= copy_range(in_fd, ranges[i].begin, nullptr, out_fd, segments[i].offset, segments[i].length);
+            close(in_fd);
+        }
+        if (!ok)
+            fprintf(stderr, "Cannot write log: %s!!\n", strerror(errno));
+        close(out_fd);
+    }
+
+    // Copies `len` bytes to `out_fd` at `off`, from `buf` or else from `in_fd`
+    // at `in_off` (in the kernel if possible).
+    static bool copy_range(int in_fd, loff_t in_off, const uint8_t *buf, int out_fd, off_t off, size_t len) {
+        loff_t out_off = off;
+        while (!buf && len) {
+            ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                // Not supported between these files: copy the rest by hand.
+                break;
+            }
+            len -= n;
+        }
+        static uint8_t chunk[1 << 16];
+        while (len) {
+            ssize_t n = len;
+            if (!buf) {
+                n = pread(in_fd, chunk, std::min(len, sizeof(chunk)), in_off);
+                if (n <= 0)
+                    return false;
+                in_off += n;
+            }
+            for (ssize_t done = 0; done < n;) {
+                ssize_t m = pwrite(out_fd, (buf ? buf : chunk) + done, n - done, out_off);
+                if (m < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                done += m, out_off += m;
+            }
+            if (buf)
+                buf += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    // Takes a slot of an exited thread if there is one, otherwise a new slot.
+    // Callers hold _lock.
+    Thread *allocThread(threadFunction *fn, void *arg) {
+        int index = _nextIndex++;
+        // A thread counts as running from its creation.
+        _lifetimes.push_back(Lifetime{now_ns(), 0});
+        if (!_freeSlots.empty()) {
+            Thread *th = &_threads[_freeSlots.back()];
+            _freeSlots.pop_back();
+            th->reuse(index, fn, arg);
+            return th;
+        }
+        int slot = (int) _threads.size();
+        EpochDomain::getInstance().add_reader(slot);
+        return &_threads.emplace_back(slot, index, fn, arg);
+    }
+
+    // True if no thread of the program is left.
+    bool removeThread(Thread *th) {
         std::lock_guard<std::mutex> lg(_lock);
+        _lifetimes[th->index].end = now_ns();
+        _freeSlots.push_back(th->slot);
         --_aliveThreads;
+        setMultithreaded();
+        return _aliveThreads == 0;
+    }
+
+    // Accesses are only logged while they could be shared. Callers hold _lock.
+    void setMultithreaded() {
+        if (_logSingle || _aliveThreads > 1)
+            __atomic_fetch_or(&__huron_multithreaded, HURON_MULTITHREADED, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_and(&__huron_multithreaded, ~HURON_MULTITHREADED, __ATOMIC_RELAXED);
     }
 
     std::mutex _lock;
-    std::vector<Thread> _threads;
+    // Thread objects, with their logs, stay in place for the whole run.
+    StableArray<Thread> _threads;
+    std::vector<int> _freeSlots;
+    std::vector<Lifetime> _lifetimes;
     int _aliveThreads;
+    int _nextIndex;
+    bool _logSingle;
 };
 
 #endif